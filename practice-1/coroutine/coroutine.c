@@ -3,12 +3,14 @@
 
 #include <assert.h>
 #include <setjmp.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "pthread.h"
+#include "slab.h"
 
 #ifdef DEBUG
 #define dbg_printf(...)                                                  \
@@ -29,17 +31,25 @@ struct coroutine_list {
 };
 
 #define STACK_SIZE 65536
+#define STACKS_PER_CHUNK 4
+#define OBJS_PER_CHUNK 256
 struct coroutine_t {
   int cid;
   int (*func)(void);
   int status;
-  int retval;
   jmp_buf env;
   uint8_t* stack;
   struct coroutine_list waiting_cors;
-  struct coroutine_t* parent;
+  // Coroutine-local storage: the first CO_INLINE_KEYS slots live here,
+  // the rest are allocated on the first co_setspecific() beyond them.
+  void* local[CO_INLINE_KEYS];
+  void** local_ext;
 };
 
+// Runtime objects come from per-thread slab caches instead of malloc, so
+// spawning and finishing coroutines never contend on the libc arenas.
+__thread struct slab_cache co_cache, node_cache, stack_cache;
+
 void add_node(struct coroutine_list* l, struct node* n) {
   n->pre = NULL;
   n->nxt = l->head;
@@ -50,7 +60,7 @@ void add_node(struct coroutine_list* l, struct node* n) {
 }
 
 void add(struct coroutine_list* l, struct coroutine_t* c) {
-  struct node* tmp = malloc(sizeof(struct node));
+  struct node* tmp = slab_alloc(&node_cache);
   tmp->c = c;
   add_node(l, tmp);
 }
@@ -84,7 +94,7 @@ struct coroutine_t* pop(struct coroutine_list* l) {
   struct node* head = l->head;
   l->head = head->nxt;
   struct coroutine_t* c = head->c;
-  free(head);
+  slab_free(head);
   l->head->pre = NULL;
   return c;
 }
@@ -98,7 +108,7 @@ void remove_without_free(struct coroutine_list* l, struct node* n) {
 
 void remove_from_list(struct coroutine_list* l, struct node* n) {
   remove_without_free(l, n);
-  free(n);
+  slab_free(n);
 }
 
 void remove_from_array(struct coroutine_t** arr, size_t* size, struct coroutine_t* c) {
@@ -128,20 +138,51 @@ void remove_all(struct coroutine_list* l) {
 // Use a thread local variable to store coroutine manager for each thread.
 __thread struct co_maganer_t {
   int is_initialized;
-  struct coroutine_t __cors[MAXN + 10];
-  struct coroutine_t* cors;
+  struct coroutine_t main_co_data;
+  // A finished coroutine goes back to its slab at once and its cors[]
+  // entry becomes NULL; its parent and return value outlive it here.
+  struct coroutine_t* cors[MAXN + 10];
+  int parents[MAXN + 10];  // cid of the creator, -1 for the main coroutine
+  int retvals[MAXN + 10];
+  // Stands in for the current coroutine between the return of a finished
+  // one and the switch to the next, so that nothing touches freed memory.
+  struct coroutine_t exit_co;
   struct coroutine_t* main_co;
   struct coroutine_t* cur_co;
   struct coroutine_t* avail_cors[MAXN + 10];
   size_t avail_cor_num;
-  struct node cor_nodes[MAXN + 10];
   int cor_num, unfinished_cor_num;
 } co_manager;
 
+pthread_key_t co_exit_key;
+pthread_once_t co_exit_key_once = PTHREAD_ONCE_INIT;
+
+// Thread exit: everything this thread's coroutines used goes away at once.
+// Only the local storage beyond the inline keys was malloc()ed, by the
+// main coroutine or by coroutines that never finished.
+void release_co_manager(void* dummy) {
+  free(co_manager.main_co_data.local_ext);
+  co_manager.main_co_data.local_ext = NULL;
+  for (int i = 0; i < co_manager.cor_num; i++) {
+    if (co_manager.cors[i] != NULL) free(co_manager.cors[i]->local_ext);
+  }
+  slab_cache_destroy(&co_cache);
+  slab_cache_destroy(&node_cache);
+  slab_cache_destroy(&stack_cache);
+  co_manager.is_initialized = 0;
+}
+
+void create_co_exit_key() { pthread_key_create(&co_exit_key, release_co_manager); }
+
 void init_co_manager() {
-  co_manager.__cors[0] = (struct coroutine_t){.cid = -1, .func = NULL, .status = RUNNING};
-  co_manager.cur_co = co_manager.main_co = co_manager.__cors;
-  co_manager.cors = co_manager.__cors + 1;
+  slab_cache_init(&co_cache, sizeof(struct coroutine_t), OBJS_PER_CHUNK);
+  slab_cache_init(&node_cache, sizeof(struct node), OBJS_PER_CHUNK);
+  slab_cache_init(&stack_cache, STACK_SIZE, STACKS_PER_CHUNK);
+  pthread_once(&co_exit_key_once, create_co_exit_key);
+  pthread_setspecific(co_exit_key, &co_manager);
+  co_manager.main_co_data = (struct coroutine_t){.cid = -1, .func = NULL, .status = RUNNING};
+  co_manager.cur_co = co_manager.main_co = &co_manager.main_co_data;
+  co_manager.exit_co = (struct coroutine_t){.cid = -2, .func = NULL, .status = FINISHED};
   co_manager.cor_num = 0;
   co_manager.unfinished_cor_num = 0;
   co_manager.avail_cors[0] = co_manager.main_co;
@@ -157,12 +198,21 @@ void continue_coroutine(struct coroutine_t* c) {
 }
 
 void coroutine_finish(int retval) {
-  dbg_printf("co #%d finished with retval %d\n", co_manager.cur_co->cid, retval);
-  co_manager.cur_co->retval = retval;
-  co_manager.cur_co->status = FINISHED;
+  struct coroutine_t* c = co_manager.cur_co;
+  dbg_printf("co #%d finished with retval %d\n", c->cid, retval);
+  co_manager.retvals[c->cid] = retval;
   co_manager.unfinished_cor_num--;
-  add_all_to_array(co_manager.avail_cors, &co_manager.avail_cor_num, &co_manager.cur_co->waiting_cors);
-  remove_from_array(co_manager.avail_cors, &co_manager.avail_cor_num, co_manager.cur_co);
+  add_all_to_array(co_manager.avail_cors, &co_manager.avail_cor_num, &c->waiting_cors);
+  remove_all(&c->waiting_cors);
+  remove_from_array(co_manager.avail_cors, &co_manager.avail_cor_num, c);
+  // We are still running on this stack, but slab_free() only writes the
+  // slab header below it, and nothing allocates before we switch away.
+  // The coroutine itself goes back to the slab of the thread that made it.
+  slab_free(c->stack);
+  free(c->local_ext);
+  co_manager.cors[c->cid] = NULL;
+  slab_free(c);
+  co_manager.cur_co = &co_manager.exit_co;
 
   // dbg_printf("co #%d parent: co #%d\n", co_manager.cur_co->cid, co_manager.cur_co->parent->cid);
   // if (co_manager.cur_co->parent->status != FINISHED) {
@@ -202,51 +252,61 @@ void run_coroutine(struct coroutine_t* c) {
 }
 
 int co_start_nonblock(int (*routine)(void)) {
-  struct coroutine_t* c = &co_manager.cors[co_manager.cor_num];
+  struct coroutine_t* c = slab_alloc(&co_cache);
+  co_manager.cors[co_manager.cor_num] = c;
   c->cid = co_manager.cor_num;
   c->func = routine;
   c->status = NEW;  // TODO
-  c->stack = malloc(STACK_SIZE);
+  c->stack = slab_alloc(&stack_cache);
   c->waiting_cors.head = NULL;
-  c->parent = co_manager.cur_co;
+  co_manager.parents[c->cid] = co_manager.cur_co->cid;
+  for (int i = 0; i < CO_INLINE_KEYS; i++) c->local[i] = NULL;
+  c->local_ext = NULL;
   add_to_array(co_manager.avail_cors, &co_manager.avail_cor_num, c);
   co_manager.cor_num++;
   co_manager.unfinished_cor_num++;
   return c->cid;
 }
 
-int co_start(int (*routine)(void)) {
+static inline void ensure_co_manager() {
   if (co_manager.is_initialized == 0) {
     init_co_manager();
     co_manager.is_initialized = 1;
   }
+}
+
+int co_start(int (*routine)(void)) {
+  ensure_co_manager();
   cid_t cid = co_start_nonblock(routine);
-  run_coroutine(&co_manager.cors[cid]);
+  run_coroutine(co_manager.cors[cid]);
   return cid;
 }
 
 int co_getid() { return co_manager.cur_co->cid; }
 
-int is_parent_of(struct coroutine_t* c) {
-  if (co_manager.cur_co == c) return 1;
-  if (co_manager.cur_co == c->parent) return 1;
-  if (c->parent != NULL) return is_parent_of(c->parent);
-  return 0;
+// Whether the current coroutine is `cid` or one of its ancestors.
+int is_parent_of(int cid) {
+  for (;; cid = co_manager.parents[cid]) {
+    if (cid == co_manager.cur_co->cid) return 1;
+    if (cid < 0) return 0;
+  }
 }
 
 int co_getret(int cid) {
-  dbg_printf("get ret of #%d, status %d\n", cid, co_manager.cors[cid].status);
+  dbg_printf("get ret of #%d, status %d\n", cid, co_status(cid));
   int retval;
-  retval = co_manager.cors[cid].retval;
+  retval = co_manager.retvals[cid];
   return retval;
 }
 
 int co_status(int cid) {
   int status;
-  if (!is_parent_of(&co_manager.cors[cid]))
+  if (!is_parent_of(cid))
     status = UNAUTHORIZED;
+  else if (co_manager.cors[cid] == NULL)
+    status = FINISHED;
   else
-    status = co_manager.cors[cid].status;
+    status = co_manager.cors[cid]->status;
   return status;
 }
 
@@ -280,8 +340,8 @@ int co_wait(int cid) {
   struct coroutine_t *cur, *c;
   int need_wait = 0;
   cur = co_manager.cur_co;
-  c = &co_manager.cors[cid];
-  if (c->status != FINISHED) {
+  c = co_manager.cors[cid];
+  if (c != NULL) {
     add(&c->waiting_cors, cur);
     remove_from_array(co_manager.avail_cors, &co_manager.avail_cor_num, cur);
     need_wait = 1;
@@ -293,4 +353,41 @@ int co_wait(int cid) {
   if (x == 0) {
     select_and_switch();
   }
-}
\ No newline at end of file
+}
+
+_Atomic int co_key_num = 0;
+
+// Keys are never deleted, so the next key is the number of keys so far.
+// The counter only moves when a key is actually handed out.
+int co_key_create(co_key_t* key) {
+  int k = atomic_load(&co_key_num);
+  do {
+    if (k >= CO_KEYS_MAX) return -1;
+  } while (!atomic_compare_exchange_weak(&co_key_num, &k, k + 1));
+  *key = k;
+  return 0;
+}
+
+void* co_getspecific(co_key_t key) {
+  ensure_co_manager();
+  struct coroutine_t* c = co_manager.cur_co;
+  if ((unsigned)key < CO_INLINE_KEYS) return c->local[key];
+  if (c->local_ext == NULL || (unsigned)key >= CO_KEYS_MAX) return NULL;
+  return c->local_ext[key - CO_INLINE_KEYS];
+}
+
+int co_setspecific(co_key_t key, const void* value) {
+  ensure_co_manager();
+  struct coroutine_t* c = co_manager.cur_co;
+  if (key < 0 || key >= CO_KEYS_MAX) return -1;
+  if (key < CO_INLINE_KEYS) {
+    c->local[key] = (void*)value;
+    return 0;
+  }
+  if (c->local_ext == NULL) {
+    c->local_ext = calloc(CO_KEYS_MAX - CO_INLINE_KEYS, sizeof(void*));
+    if (c->local_ext == NULL) return -1;
+  }
+  c->local_ext[key - CO_INLINE_KEYS] = (void*)value;
+  return 0;
+}
@@ -9,6 +9,10 @@ typedef long long cid_t;
 #define RUNNING (1)
 #define NEW (3)
 
+typedef int co_key_t;
+#define CO_INLINE_KEYS (8)
+#define CO_KEYS_MAX (1024)
+
 int co_start(int (*routine)(void));
 int co_getid();
 int co_getret(int cid);
@@ -17,4 +21,10 @@ int co_waitall();
 int co_wait(int cid);
 int co_status(int cid);
 
+// Coroutine-local storage, the coroutine counterpart of pthread keys.
+// Values start out NULL in every coroutine and are not inherited.
+int co_key_create(co_key_t* key);
+void* co_getspecific(co_key_t key);
+int co_setspecific(co_key_t key, const void* value);
+
 #endif
@@ -1,7 +1,9 @@
 #include "coroutine.h"
 #include "utils.h"
+#include "slab.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <sys/time.h>
@@ -43,6 +45,22 @@ int test_getid(void){
     return getid_val;
 }
 
+//test coroutine-local storage
+co_key_t local_key[CO_INLINE_KEYS + 2];
+
+int test_local(void){
+    intptr_t me = co_getid() + 1;
+    for(int k = 0; k < CO_INLINE_KEYS + 2; ++k){
+        if(co_getspecific(local_key[k]) != NULL) fail("Local value not NULL initially", __func__, __LINE__);
+        co_setspecific(local_key[k], (void*)(me * 100 + k));
+    }
+    co_yield();
+    for(int k = 0; k < CO_INLINE_KEYS + 2; ++k){
+        if(co_getspecific(local_key[k]) != (void*)(me * 100 + k)) fail("Local value changed by other coroutine", __func__, __LINE__);
+    }
+    return 0;
+}
+
 //test multithread
 _Atomic int total_coroutine_count = 0;
 
@@ -113,6 +131,41 @@ int test_multithread_timer() {
     printf("Multithread time: %lf ms\n", (stop.tv_sec - start.tv_sec) * 1000 + (stop.tv_usec - start.tv_usec) / 1000.0);
 }
 
+//test remote frees: coroutine objects come from the slab of the thread
+//that starts them, and another thread that frees them must hand them back
+//to that slab, not to its own
+#define REMOTE_CNT 64
+struct slab_cache remote_cache;
+void* remote_objs[REMOTE_CNT];
+
+void* test_remote_free_thread(void *ptr) {
+    for(int i = 0; i < REMOTE_CNT; ++i) slab_free(remote_objs[i]);
+    return NULL;
+}
+
+int test_remote_free() {
+    slab_cache_init(&remote_cache, 256, REMOTE_CNT);
+    for(int i = 0; i < REMOTE_CNT; ++i) remote_objs[i] = slab_alloc(&remote_cache);
+    pthread_t thread;
+    pthread_create(&thread, NULL, test_remote_free_thread, NULL);
+    pthread_join(thread, NULL);
+    // The cache is empty, so every object must come back from the remote list.
+    for(int i = 0; i < REMOTE_CNT; ++i) {
+        void* p = slab_alloc(&remote_cache);
+        int found = 0;
+        for(int j = 0; j < REMOTE_CNT; ++j) {
+            if(remote_objs[j] == p) {
+                remote_objs[j] = NULL;
+                found = 1;
+            }
+        }
+        if(!found) fail("Remote free did not return the object to its slab", __func__, __LINE__);
+    }
+    slab_cache_destroy(&remote_cache);
+    printf("Main: test remote free finished.\n");
+    return 0;
+}
+
 int main(){
     srand(0);
     cid_t coroutine[20];
@@ -148,6 +201,14 @@ int main(){
     if(coroutine[0] != getid_val) fail("Get ID differs from internal getid", __func__, __LINE__);
     if(coroutine[0] != co_getret(getid_val)) fail("Get ID differs from internal return value", __func__, __LINE__);
     printf("Main: test getid finished.\n");
+    // test coroutine-local storage
+    for(int k = 0; k < CO_INLINE_KEYS + 2; ++k) if(co_key_create(&local_key[k]) != 0) fail("Key creation failed", __func__, __LINE__);
+    co_setspecific(local_key[0], &getid_val);
+    for(int i = 0; i < 4; ++i) coroutine[i] = co_start(test_local);
+    co_waitall();
+    if(co_getspecific(local_key[0]) != &getid_val) fail("Main local value changed", __func__, __LINE__);
+    printf("Main: test local storage finished.\n");
+    test_remote_free();
     test_multithread();
     test_multithread_timer();
     printf("Finish running.\n");
@@ -0,0 +1,91 @@
+#include "slab.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Every object is preceded by a header naming its cache, so slab_free()
+// needs nothing but the pointer. The free-list link lives in the header
+// too, so freeing never writes into the object itself.
+struct slab_obj {
+  struct slab_cache* owner;
+  struct slab_obj* next;
+};
+
+#define SLAB_HEADER 16
+#define obj_of(p) ((struct slab_obj*)((uint8_t*)(p)-SLAB_HEADER))
+#define data_of(o) ((void*)((uint8_t*)(o) + SLAB_HEADER))
+
+struct slab_chunk {
+  struct slab_chunk* next;
+  uint8_t pad[SLAB_HEADER - sizeof(struct slab_chunk*)];
+};
+
+void slab_cache_init(struct slab_cache* c, size_t size, size_t per_chunk) {
+  c->size = (size + 15) & ~(size_t)15;
+  c->per_chunk = per_chunk;
+  c->owner = pthread_self();
+  c->free = NULL;
+  c->remote = NULL;
+  c->chunks = NULL;
+}
+
+void slab_cache_destroy(struct slab_cache* c) {
+  struct slab_chunk* ch = c->chunks;
+  while (ch != NULL) {
+    struct slab_chunk* next = ch->next;
+    free(ch);
+    ch = next;
+  }
+  c->chunks = NULL;
+  c->free = NULL;
+  c->remote = NULL;
+}
+
+static void refill(struct slab_cache* c) {
+  // Objects returned by other threads first, then fresh memory.
+  struct slab_obj* remote = __atomic_exchange_n(&c->remote, NULL, __ATOMIC_ACQUIRE);
+  if (remote != NULL) {
+    c->free = remote;
+    return;
+  }
+  size_t stride = SLAB_HEADER + c->size;
+  struct slab_chunk* ch = malloc(sizeof(struct slab_chunk) + stride * c->per_chunk);
+  if (ch == NULL) return;
+  ch->next = c->chunks;
+  c->chunks = ch;
+  uint8_t* p = (uint8_t*)(ch + 1);
+  for (size_t i = 0; i < c->per_chunk; i++, p += stride) {
+    struct slab_obj* o = (struct slab_obj*)p;
+    o->owner = c;
+    o->next = c->free;
+    c->free = o;
+  }
+}
+
+void* slab_alloc(struct slab_cache* c) {
+  if (c->free == NULL) {
+    refill(c);
+    if (c->free == NULL) return NULL;
+  }
+  struct slab_obj* o = c->free;
+  c->free = o->next;
+  return data_of(o);
+}
+
+void slab_free(void* p) {
+  if (p == NULL) return;
+  struct slab_obj* o = obj_of(p);
+  struct slab_cache* c = o->owner;
+  if (pthread_equal(c->owner, pthread_self())) {
+    o->next = c->free;
+    c->free = o;
+    return;
+  }
+  // Only the owner ever takes from the remote list, and it takes all of
+  // it at once, so a plain CAS push is free of ABA.
+  struct slab_obj* head = __atomic_load_n(&c->remote, __ATOMIC_RELAXED);
+  do {
+    o->next = head;
+  } while (!__atomic_compare_exchange_n(&c->remote, &head, o, 1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
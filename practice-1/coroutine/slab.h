@@ -0,0 +1,34 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Per-thread cache of fixed-size objects. The owning thread allocates and
+// frees without any lock; other threads hand objects back through a
+// lock-free remote-free list that the owner drains when it runs dry.
+
+struct slab_obj;
+struct slab_chunk;
+
+struct slab_cache {
+  size_t size;       // object size, rounded up to 16 bytes
+  size_t per_chunk;  // objects carved from one malloc() call
+  pthread_t owner;
+  struct slab_obj* free;
+  struct slab_obj* _Atomic remote;
+  struct slab_chunk* chunks;
+};
+
+// Must be called on the thread that will own the cache.
+void slab_cache_init(struct slab_cache* c, size_t size, size_t per_chunk);
+
+// Release every chunk. Objects of this cache must no longer be in use.
+void slab_cache_destroy(struct slab_cache* c);
+
+void* slab_alloc(struct slab_cache* c);
+
+// May be called from any thread while the owning cache is alive.
+void slab_free(void* p);
+
+#endif
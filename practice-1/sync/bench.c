@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "sync.h"
+
+// Contention benchmark. Every lock protects the critical section of
+// practice 1-1 task2 (print "HelloWorld!" 20 times), with the prints
+// replaced by stores into a shared buffer so that the terminal is not
+// what we measure. Every run checks that no write section was lost, and
+// that no read section of the rwlocks overlapped a write section.
+
+#define DEFAULT_ITERS 20000
+#define READS_PER_WRITE 16
+
+enum lock_kind {
+  PTHREAD_MUTEX,
+  TICKET,
+  MCS,
+  ADAPTIVE,
+  PTHREAD_RWLOCK,
+  PERCPU_RWLOCK,
+  LOCK_KIND_NUM,
+};
+
+static const char* lock_name[LOCK_KIND_NUM] = {
+    "pthread_mutex", "ticket", "mcs", "adaptive", "pthread_rwlock", "percpu_rwlock",
+};
+
+pthread_mutex_t pmutex;
+struct ticket_lock tlock;
+struct mcs_lock mlock;
+struct adaptive_mutex amutex;
+pthread_rwlock_t prwlock;
+struct rwlock rwlock;
+
+volatile char shared_buf[4096];
+size_t shared_pos;
+volatile long shared_sum;
+// A write section bumps write_begin on entry and write_end on exit, so
+// they differ exactly while a writer is inside.
+volatile long write_begin, write_end;
+_Atomic long write_count, torn_reads;
+
+enum lock_kind cur_kind;
+int iters;
+pthread_barrier_t barrier;
+
+void write_section() {
+  static const char msg[] = "HelloWorld!";
+  long gen = write_begin + 1;
+  write_begin = gen;
+  for (int i = 0; i < 20; ++i) {
+    for (int j = 0; j < 11; ++j) {
+      shared_buf[shared_pos++ % sizeof(shared_buf)] = msg[j];
+    }
+  }
+  write_end = gen;
+}
+
+void read_section() {
+  long sum = 0, gen = write_end;
+  if (write_begin != gen) torn_reads++;
+  for (int i = 0; i < 220; ++i) {
+    sum += shared_buf[i];
+  }
+  if (write_begin != gen) torn_reads++;
+  shared_sum = sum;
+}
+
+void* worker(void* dummy) {
+  struct mcs_node node;
+  long writes = 0;
+  pthread_barrier_wait(&barrier);
+  for (int i = 0; i < iters; ++i) {
+    int is_write = cur_kind <= ADAPTIVE || i % READS_PER_WRITE == 0;
+    writes += is_write;
+    switch (cur_kind) {
+      case PTHREAD_MUTEX:
+        pthread_mutex_lock(&pmutex);
+        write_section();
+        pthread_mutex_unlock(&pmutex);
+        break;
+      case TICKET:
+        ticket_lock(&tlock);
+        write_section();
+        ticket_unlock(&tlock);
+        break;
+      case MCS:
+        mcs_lock(&mlock, &node);
+        write_section();
+        mcs_unlock(&mlock, &node);
+        break;
+      case ADAPTIVE:
+        adaptive_mutex_lock(&amutex);
+        write_section();
+        adaptive_mutex_unlock(&amutex);
+        break;
+      case PTHREAD_RWLOCK:
+        if (is_write) {
+          pthread_rwlock_wrlock(&prwlock);
+          write_section();
+        } else {
+          pthread_rwlock_rdlock(&prwlock);
+          read_section();
+        }
+        pthread_rwlock_unlock(&prwlock);
+        break;
+      case PERCPU_RWLOCK:
+        if (is_write) {
+          rwlock_wrlock(&rwlock);
+          write_section();
+          rwlock_wrunlock(&rwlock);
+        } else {
+          int slot = rwlock_rdlock(&rwlock);
+          read_section();
+          rwlock_rdunlock(&rwlock, slot);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  write_count += writes;
+  return NULL;
+}
+
+double run(enum lock_kind kind, int nthread) {
+  pthread_t pid[nthread];
+  struct timeval start, stop;
+  cur_kind = kind;
+  shared_pos = 0;
+  write_begin = write_end = 0;
+  write_count = torn_reads = 0;
+  pthread_barrier_init(&barrier, NULL, nthread + 1);
+  for (int i = 0; i < nthread; ++i) {
+    pthread_create(&pid[i], NULL, worker, NULL);
+  }
+  gettimeofday(&start, NULL);
+  pthread_barrier_wait(&barrier);
+  for (int i = 0; i < nthread; ++i) {
+    pthread_join(pid[i], NULL);
+  }
+  gettimeofday(&stop, NULL);
+  pthread_barrier_destroy(&barrier);
+
+  if (shared_pos != (size_t)write_count * 220) {
+    printf("[x] %s lost updates: %zu of %ld\n", lock_name[kind], shared_pos, write_count * 220);
+    exit(-1);
+  }
+  if (torn_reads != 0) {
+    printf("[x] %s: %ld reads saw a write in progress\n", lock_name[kind], torn_reads);
+    exit(-1);
+  }
+  double secs = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+  return (double)nthread * iters / secs;
+}
+
+int main(int argc, char* argv[]) {
+  int max_thread = argc > 1 ? atoi(argv[1]) : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+  iters = argc > 2 ? atoi(argv[2]) : DEFAULT_ITERS;
+
+  pthread_mutex_init(&pmutex, NULL);
+  ticket_lock_init(&tlock);
+  mcs_lock_init(&mlock);
+  adaptive_mutex_init(&amutex);
+  pthread_rwlock_init(&prwlock, NULL);
+  rwlock_init(&rwlock);
+
+  printf("%-8s", "threads");
+  for (int k = 0; k < LOCK_KIND_NUM; ++k) printf("%16s", lock_name[k]);
+  printf("\n");
+  for (int n = 1; n <= max_thread; n = n < 4 ? n + 1 : n * 2) {
+    printf("%-8d", n);
+    for (int k = 0; k < LOCK_KIND_NUM; ++k) {
+      printf("%16.0f", run(k, n));
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+  printf("(critical sections per second; rwlocks do %d reads per write)\n", READS_PER_WRITE - 1);
+  pthread_mutex_destroy(&pmutex);
+  pthread_rwlock_destroy(&prwlock);
+  return 0;
+}
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include "sync.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// How many times a waiter polls before it goes to sleep in the kernel.
+#define SPIN_LIMIT 128
+#define ADAPTIVE_MAX_SPIN 1000
+
+static inline void cpu_relax() {
+#if __x86_64__ || __i386__
+  __builtin_ia32_pause();
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline void futex_wait(_Atomic uint32_t* addr, uint32_t val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(_Atomic uint32_t* addr, int nr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+/* ticket lock */
+
+void ticket_lock_init(struct ticket_lock* l) {
+  l->next = 0;
+  l->owner = 0;
+  l->waiters = 0;
+}
+
+void ticket_lock(struct ticket_lock* l) {
+  uint32_t ticket = l->next++;
+  for (int i = 0; i < SPIN_LIMIT; i++) {
+    if (l->owner == ticket) return;
+    cpu_relax();
+  }
+  l->waiters++;
+  uint32_t cur;
+  while ((cur = l->owner) != ticket) {
+    futex_wait(&l->owner, cur);
+  }
+  l->waiters--;
+}
+
+void ticket_unlock(struct ticket_lock* l) {
+  l->owner++;
+  // Every sleeper waits for its own ticket, so all of them have to be
+  // woken up to re-check.
+  if (l->waiters != 0) futex_wake(&l->owner, INT_MAX);
+}
+
+/* MCS lock */
+
+// States of mcs_node.locked.
+#define MCS_UNLOCKED 0
+#define MCS_SPINNING 1
+#define MCS_SLEEPING 2
+
+void mcs_lock_init(struct mcs_lock* l) { l->tail = NULL; }
+
+void mcs_lock(struct mcs_lock* l, struct mcs_node* n) {
+  n->next = NULL;
+  n->locked = MCS_SPINNING;
+  struct mcs_node* prev = __atomic_exchange_n(&l->tail, n, __ATOMIC_ACQ_REL);
+  if (prev == NULL) return;
+  prev->next = n;
+  for (int i = 0; i < SPIN_LIMIT; i++) {
+    if (n->locked == MCS_UNLOCKED) return;
+    cpu_relax();
+  }
+  uint32_t expected = MCS_SPINNING;
+  if (!__atomic_compare_exchange_n(&n->locked, &expected, MCS_SLEEPING, 0, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE))
+    return;  // handed over while we were about to sleep
+  while (n->locked != MCS_UNLOCKED) {
+    futex_wait(&n->locked, MCS_SLEEPING);
+  }
+}
+
+void mcs_unlock(struct mcs_lock* l, struct mcs_node* n) {
+  struct mcs_node* succ = n->next;
+  if (succ == NULL) {
+    struct mcs_node* expected = n;
+    if (__atomic_compare_exchange_n(&l->tail, &expected, NULL, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      return;
+    // A successor swapped itself in but has not linked to us yet.
+    while ((succ = n->next) == NULL) cpu_relax();
+  }
+  if (__atomic_exchange_n(&succ->locked, MCS_UNLOCKED, __ATOMIC_ACQ_REL) == MCS_SLEEPING)
+    futex_wake(&succ->locked, 1);
+}
+
+/* adaptive mutex */
+
+void adaptive_mutex_init(struct adaptive_mutex* m) {
+  m->state = 0;
+  m->spins = 0;
+}
+
+static inline int cas_state(struct adaptive_mutex* m, uint32_t from, uint32_t to) {
+  return __atomic_compare_exchange_n(&m->state, &from, to, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+int adaptive_mutex_trylock(struct adaptive_mutex* m) { return cas_state(m, 0, 1); }
+
+void adaptive_mutex_lock(struct adaptive_mutex* m) {
+  if (cas_state(m, 0, 1)) return;
+
+  int max_spin = m->spins * 2 + 10;
+  if (max_spin > ADAPTIVE_MAX_SPIN) max_spin = ADAPTIVE_MAX_SPIN;
+  for (int cnt = 0; cnt < max_spin; cnt++) {
+    if (m->state == 0 && cas_state(m, 0, 1)) {
+      // Move the estimate 1/8 of the way towards what this wait took.
+      m->spins += (cnt - m->spins) / 8;
+      return;
+    }
+    cpu_relax();
+  }
+  m->spins += (max_spin - m->spins) / 8;
+
+  // Park. Once we have slept, keep the state at 2 so that whoever
+  // releases the lock after us knows there may be other sleepers.
+  while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0) {
+    futex_wait(&m->state, 2);
+  }
+}
+
+void adaptive_mutex_unlock(struct adaptive_mutex* m) {
+  if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2) futex_wake(&m->state, 1);
+}
+
+/* reader-writer lock */
+
+void rwlock_init(struct rwlock* l) {
+  for (int i = 0; i < SYNC_MAX_CPUS; i++) {
+    l->slot[i].readers = 0;
+  }
+  l->writer = 0;
+  l->drain_gen = 0;
+  adaptive_mutex_init(&l->wlock);
+}
+
+static inline int reader_slot() {
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : cpu % SYNC_MAX_CPUS;
+}
+
+static inline long active_readers(struct rwlock* l) {
+  long sum = 0;
+  for (int i = 0; i < SYNC_MAX_CPUS; i++) {
+    sum += l->slot[i].readers;
+  }
+  return sum;
+}
+
+static void reader_leave(struct rwlock* l, int slot) {
+  l->slot[slot].readers--;
+  // The writer sets `writer` before summing the counters and we decrement
+  // before reading it, so either it sees our decrement or we see it.
+  if (l->writer != 0) {
+    l->drain_gen++;
+    futex_wake(&l->drain_gen, 1);
+  }
+}
+
+int rwlock_rdlock(struct rwlock* l) {
+  for (;;) {
+    int slot = reader_slot();
+    l->slot[slot].readers++;
+    if (l->writer == 0) return slot;
+    // A writer holds the lock or is waiting for it: back off so it is
+    // not starved by a steady stream of readers.
+    reader_leave(l, slot);
+    uint32_t w;
+    while ((w = l->writer) != 0) {
+      futex_wait(&l->writer, w);
+    }
+  }
+}
+
+void rwlock_rdunlock(struct rwlock* l, int slot) { reader_leave(l, slot); }
+
+void rwlock_wrlock(struct rwlock* l) {
+  l->writer++;
+  adaptive_mutex_lock(&l->wlock);
+  for (int i = 0; active_readers(l) != 0; i++) {
+    if (i < SPIN_LIMIT) {
+      cpu_relax();
+      continue;
+    }
+    uint32_t gen = l->drain_gen;
+    if (active_readers(l) == 0) break;
+    futex_wait(&l->drain_gen, gen);
+  }
+}
+
+void rwlock_wrunlock(struct rwlock* l) {
+  adaptive_mutex_unlock(&l->wlock);
+  if (--l->writer == 0) futex_wake(&l->writer, INT_MAX);
+}
@@ -0,0 +1,73 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+
+// Futex-based synchronization primitives. All locks are statically
+// initializable by zeroing them, and none of them allocate memory.
+
+#define SYNC_CACHELINE 64
+#define SYNC_MAX_CPUS 64
+
+// FIFO ticket lock. Waiters spin briefly on `owner`, then sleep on it.
+struct ticket_lock {
+  _Atomic uint32_t next;
+  _Atomic uint32_t owner;
+  _Atomic uint32_t waiters;
+};
+
+void ticket_lock_init(struct ticket_lock* l);
+void ticket_lock(struct ticket_lock* l);
+void ticket_unlock(struct ticket_lock* l);
+
+// MCS queue lock. Every waiter spins (and then sleeps) on its own node,
+// so a release touches exactly one other cache line. The node must stay
+// alive between mcs_lock() and mcs_unlock().
+struct mcs_node {
+  struct mcs_node* _Atomic next;
+  _Atomic uint32_t locked;
+};
+
+struct mcs_lock {
+  struct mcs_node* _Atomic tail;
+};
+
+void mcs_lock_init(struct mcs_lock* l);
+void mcs_lock(struct mcs_lock* l, struct mcs_node* n);
+void mcs_unlock(struct mcs_lock* l, struct mcs_node* n);
+
+// Spin-then-park mutex. `state` is 0 (unlocked), 1 (locked) or 2 (locked
+// with sleepers). The spin budget adapts to how long the lock was held
+// the last time spinning succeeded, like PTHREAD_MUTEX_ADAPTIVE_NP.
+struct adaptive_mutex {
+  _Atomic uint32_t state;
+  _Atomic int32_t spins;
+};
+
+void adaptive_mutex_init(struct adaptive_mutex* m);
+void adaptive_mutex_lock(struct adaptive_mutex* m);
+int adaptive_mutex_trylock(struct adaptive_mutex* m);
+void adaptive_mutex_unlock(struct adaptive_mutex* m);
+
+// Writer-preferring reader-writer lock. Readers only touch the counter of
+// the CPU they run on, so concurrent readers do not bounce a shared cache
+// line. rwlock_rdlock() returns the slot it used; pass it back to
+// rwlock_rdunlock() since the thread may have migrated in between.
+struct rw_reader_slot {
+  _Atomic long readers;
+} __attribute__((aligned(SYNC_CACHELINE)));
+
+struct rwlock {
+  struct rw_reader_slot slot[SYNC_MAX_CPUS];
+  _Atomic uint32_t writer;     // nonzero while a writer holds or waits
+  _Atomic uint32_t drain_gen;  // bumped by readers leaving under a writer
+  struct adaptive_mutex wlock; // serializes writers
+};
+
+void rwlock_init(struct rwlock* l);
+int rwlock_rdlock(struct rwlock* l);
+void rwlock_rdunlock(struct rwlock* l, int slot);
+void rwlock_wrlock(struct rwlock* l);
+void rwlock_wrunlock(struct rwlock* l);
+
+#endif
@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../topology/topology.h"
+#include "threadpool.h"
+
+// Tiny-task throughput: task1's create-one-thread-per-unit-of-work pattern
+// against the same work submitted to a thread pool.
+
+#define MAXTHREAD 10
+#define DEFAULT_TASKS 100000
+
+_Atomic long done_count;
+
+// The body of task1's thread1 without the terminal output.
+void* tiny_task(void* dummy) {
+  static const char msg[] = "HelloWorld!";
+  intptr_t sum = (intptr_t)dummy;
+  for (int i = 0; i < 20; ++i) {
+    for (int j = 0; j < 11; ++j) {
+      sum += msg[j];
+    }
+  }
+  done_count++;
+  return (void*)sum;
+}
+
+double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// task1: MAXTHREAD pthread_create calls, then join them all.
+double bench_create_join(int ntask) {
+  pthread_t pid[MAXTHREAD];
+  double start = now();
+  for (int done = 0; done < ntask; done += MAXTHREAD) {
+    for (int i = 0; i < MAXTHREAD; ++i) {
+      pthread_create(&pid[i], NULL, tiny_task, (void*)(intptr_t)i);
+    }
+    for (int i = 0; i < MAXTHREAD; ++i) {
+      pthread_join(pid[i], NULL);
+    }
+  }
+  return ntask / (now() - start);
+}
+
+// Same batches of MAXTHREAD, each task waited for through its future.
+double bench_pool_batch(struct threadpool* pool, int ntask) {
+  struct tp_task* task[MAXTHREAD];
+  double start = now();
+  for (int done = 0; done < ntask; done += MAXTHREAD) {
+    for (int i = 0; i < MAXTHREAD; ++i) {
+      task[i] = tp_submit(pool, tiny_task, (void*)(intptr_t)i);
+    }
+    for (int i = 0; i < MAXTHREAD; ++i) {
+      tp_wait(task[i]);
+    }
+  }
+  return ntask / (now() - start);
+}
+
+// One big fan-out: idle workers steal from each other's deques.
+double bench_pool_all(struct threadpool* pool, int ntask) {
+  struct tp_task** task = malloc(sizeof(struct tp_task*) * ntask);
+  double start = now();
+  for (int i = 0; i < ntask; ++i) {
+    task[i] = tp_submit(pool, tiny_task, (void*)(intptr_t)i);
+  }
+  for (int i = 0; i < ntask; ++i) {
+    tp_wait(task[i]);
+  }
+  double rate = ntask / (now() - start);
+  free(task);
+  return rate;
+}
+
+int main(int argc, char* argv[]) {
+  int nthread = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  int ntask = argc > 2 ? atoi(argv[2]) : DEFAULT_TASKS;
+  ntask -= ntask % MAXTHREAD;
+
+  // Optional third argument: pin the workers with a placement policy.
+  struct cpu_topology topo;
+  int cpus[nthread];
+  const char* policy = argc > 3 ? argv[3] : NULL;
+  int bind = policy != NULL && topology_discover(&topo) == 0;
+  if (bind && strcmp(policy, "scatter") == 0)
+    topology_place(&topo, PLACE_SCATTER, nthread, cpus);
+  else if (bind && strcmp(policy, "core") == 0)
+    topology_place(&topo, PLACE_ONE_PER_CORE, nthread, cpus);
+  else if (bind)
+    topology_place(&topo, PLACE_COMPACT, nthread, cpus);
+
+  struct threadpool* pool = tp_create(nthread, bind ? cpus : NULL, nthread);
+  done_count = 0;
+  printf("create/join per task: %12.0f tasks/s\n", bench_create_join(ntask));
+  printf("pool, batches of %d:  %12.0f tasks/s\n", MAXTHREAD, bench_pool_batch(pool, ntask));
+  printf("pool, submit all:     %12.0f tasks/s\n", bench_pool_all(pool, ntask));
+  tp_destroy(pool);
+  if (done_count != 3L * ntask) {
+    printf("[x] lost tasks: %ld of %d\n", done_count, 3 * ntask);
+    return -1;
+  }
+  printf("(%d workers%s%s, %d tasks per run)\n", nthread, bind ? ", placement " : "",
+         bind ? policy : "", ntask);
+  return 0;
+}
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include "threadpool.h"
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../sync/sync.h"
+
+#define DEQUE_INIT_CAP 64
+
+// States of tp_task.state.
+#define TASK_PENDING 0
+#define TASK_WAITING 1  // a thread outside the pool sleeps on it
+#define TASK_DONE 2
+
+struct tp_task {
+  tp_func_t func;
+  void* arg;
+  void* ret;
+  _Atomic uint32_t state;
+};
+
+// Tasks live in buf[top % cap .. bottom % cap). The owner works at the
+// bottom (LIFO, cache-warm), thieves take from the top (oldest work).
+struct deque {
+  struct adaptive_mutex lock;
+  struct tp_task** buf;
+  long cap;
+  long top, bottom;
+} __attribute__((aligned(SYNC_CACHELINE)));
+
+struct worker {
+  struct threadpool* pool;
+  int id;
+  uint32_t seed;
+  pthread_t tid;
+  struct deque dq;
+};
+
+struct threadpool {
+  int nthread;
+  struct worker* workers;
+  _Atomic long pending;  // queued but not yet taken tasks
+  _Atomic uint32_t rr;
+  _Atomic int sleepers;
+  int shutdown;
+  pthread_mutex_t idle_mutex;
+  pthread_cond_t idle_cond;
+};
+
+static __thread struct worker* cur_worker;
+
+static int deque_init(struct deque* dq) {
+  adaptive_mutex_init(&dq->lock);
+  dq->cap = DEQUE_INIT_CAP;
+  dq->buf = malloc(sizeof(struct tp_task*) * dq->cap);
+  dq->top = dq->bottom = 0;
+  return dq->buf != NULL ? 0 : -1;
+}
+
+// Returns -1 if the deque is full and cannot grow.
+static int push_bottom(struct deque* dq, struct tp_task* t) {
+  adaptive_mutex_lock(&dq->lock);
+  if (dq->bottom - dq->top == dq->cap) {
+    struct tp_task** buf = malloc(sizeof(struct tp_task*) * dq->cap * 2);
+    if (buf == NULL) {
+      adaptive_mutex_unlock(&dq->lock);
+      return -1;
+    }
+    for (long i = dq->top; i < dq->bottom; i++) {
+      buf[i % (dq->cap * 2)] = dq->buf[i % dq->cap];
+    }
+    free(dq->buf);
+    dq->buf = buf;
+    dq->cap *= 2;
+  }
+  dq->buf[dq->bottom % dq->cap] = t;
+  dq->bottom++;
+  adaptive_mutex_unlock(&dq->lock);
+  return 0;
+}
+
+static struct tp_task* pop_bottom(struct deque* dq) {
+  struct tp_task* t = NULL;
+  adaptive_mutex_lock(&dq->lock);
+  if (dq->bottom > dq->top) {
+    dq->bottom--;
+    t = dq->buf[dq->bottom % dq->cap];
+  }
+  adaptive_mutex_unlock(&dq->lock);
+  return t;
+}
+
+static struct tp_task* steal_top(struct deque* dq) {
+  struct tp_task* t = NULL;
+  // Racy emptiness check: do not bother the owner for nothing.
+  if (dq->bottom <= dq->top) return NULL;
+  if (!adaptive_mutex_trylock(&dq->lock)) return NULL;
+  if (dq->bottom > dq->top) {
+    t = dq->buf[dq->top % dq->cap];
+    dq->top++;
+  }
+  adaptive_mutex_unlock(&dq->lock);
+  return t;
+}
+
+static struct tp_task* find_task(struct worker* w) {
+  struct threadpool* pool = w->pool;
+  struct tp_task* t = pop_bottom(&w->dq);
+  if (t == NULL) {
+    w->seed = w->seed * 1103515245 + 12345;
+    int start = (w->seed >> 16) % pool->nthread;
+    for (int i = 0; i < pool->nthread && t == NULL; i++) {
+      struct worker* victim = &pool->workers[(start + i) % pool->nthread];
+      if (victim != w) t = steal_top(&victim->dq);
+    }
+  }
+  if (t != NULL) pool->pending--;
+  return t;
+}
+
+static void run_task(struct tp_task* t) {
+  t->ret = t->func(t->arg);
+  if (__atomic_exchange_n(&t->state, TASK_DONE, __ATOMIC_ACQ_REL) == TASK_WAITING)
+    syscall(SYS_futex, &t->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Sleep until there is work. Return 1 if the worker should exit.
+static int park(struct threadpool* pool) {
+  int stop;
+  pthread_mutex_lock(&pool->idle_mutex);
+  pool->sleepers++;
+  while (pool->pending <= 0 && !pool->shutdown) {
+    pthread_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+  }
+  pool->sleepers--;
+  stop = pool->shutdown && pool->pending <= 0;
+  pthread_mutex_unlock(&pool->idle_mutex);
+  return stop;
+}
+
+static void* worker_main(void* arg) {
+  struct worker* w = arg;
+  cur_worker = w;
+  for (;;) {
+    struct tp_task* t = find_task(w);
+    if (t != NULL) {
+      run_task(t);
+    } else if (w->pool->pending <= 0 && park(w->pool)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Stop the first `started` workers once the queues are empty, and free
+// the pool with the deques of its first `ndeque` workers.
+static void release_pool(struct threadpool* pool, int started, int ndeque) {
+  pthread_mutex_lock(&pool->idle_mutex);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->idle_cond);
+  pthread_mutex_unlock(&pool->idle_mutex);
+  for (int i = 0; i < started; i++) pthread_join(pool->workers[i].tid, NULL);
+  for (int i = 0; i < ndeque; i++) free(pool->workers[i].dq.buf);
+  pthread_mutex_destroy(&pool->idle_mutex);
+  pthread_cond_destroy(&pool->idle_cond);
+  free(pool->workers);
+  free(pool);
+}
+
+struct threadpool* tp_create(int nthread, const int* cpus, int ncpu) {
+  struct threadpool* pool = malloc(sizeof(struct threadpool));
+  if (pool == NULL) return NULL;
+  pool->nthread = nthread;
+  pool->workers = aligned_alloc(SYNC_CACHELINE, sizeof(struct worker) * nthread);
+  if (pool->workers == NULL) {
+    free(pool);
+    return NULL;
+  }
+  pool->pending = 0;
+  pool->rr = 0;
+  pool->sleepers = 0;
+  pool->shutdown = 0;
+  pthread_mutex_init(&pool->idle_mutex, NULL);
+  pthread_cond_init(&pool->idle_cond, NULL);
+  for (int i = 0; i < nthread; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].id = i;
+    pool->workers[i].seed = i + 1;
+    if (deque_init(&pool->workers[i].dq) != 0) {
+      release_pool(pool, 0, i);
+      return NULL;
+    }
+  }
+  for (int i = 0; i < nthread; i++) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpus != NULL && ncpu > 0) {
+      cpu_set_t cpu;
+      CPU_ZERO(&cpu);
+      CPU_SET(cpus[i % ncpu], &cpu);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpu);
+    }
+    int ret = pthread_create(&pool->workers[i].tid, &attr, worker_main, &pool->workers[i]);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+      release_pool(pool, i, nthread);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+void tp_destroy(struct threadpool* pool) { release_pool(pool, pool->nthread, pool->nthread); }
+
+struct tp_task* tp_submit_to(struct threadpool* pool, int worker, tp_func_t func, void* arg) {
+  struct tp_task* t = malloc(sizeof(struct tp_task));
+  if (t == NULL) return NULL;
+  t->func = func;
+  t->arg = arg;
+  t->state = TASK_PENDING;
+  if (push_bottom(&pool->workers[worker % pool->nthread].dq, t) != 0) {
+    free(t);
+    return NULL;
+  }
+  pool->pending++;
+  if (pool->sleepers > 0) {
+    pthread_mutex_lock(&pool->idle_mutex);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_mutex);
+  }
+  return t;
+}
+
+struct tp_task* tp_submit(struct threadpool* pool, tp_func_t func, void* arg) {
+  int worker;
+  if (cur_worker != NULL && cur_worker->pool == pool)
+    worker = cur_worker->id;
+  else
+    worker = pool->rr++ % pool->nthread;
+  return tp_submit_to(pool, worker, func, arg);
+}
+
+void* tp_wait(struct tp_task* t) {
+  if (cur_worker != NULL) {
+    // Help instead of blocking, otherwise nested waits could leave no
+    // worker to run the task being waited for.
+    while (t->state != TASK_DONE) {
+      struct tp_task* other = find_task(cur_worker);
+      if (other != NULL)
+        run_task(other);
+      else
+        sched_yield();
+    }
+  } else {
+    uint32_t expected = TASK_PENDING;
+    __atomic_compare_exchange_n(&t->state, &expected, TASK_WAITING, 0, __ATOMIC_ACQ_REL,
+                                __ATOMIC_ACQUIRE);
+    while (t->state != TASK_DONE) {
+      syscall(SYS_futex, &t->state, FUTEX_WAIT_PRIVATE, TASK_WAITING, NULL, NULL, 0);
+    }
+  }
+  void* ret = t->ret;
+  free(t);
+  return ret;
+}
+
+int tp_worker_id() { return cur_worker != NULL ? cur_worker->id : -1; }
@@ -0,0 +1,38 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops
+// its own work at the bottom, and idle workers steal from the top of the
+// others' deques.
+
+typedef void* (*tp_func_t)(void* arg);
+
+struct threadpool;
+struct tp_task;  // also serves as the future of the submitted work
+
+// Create a pool of `nthread` workers. If `cpus` is not NULL, worker i is
+// bound to cpus[i % ncpu] the same way task5 binds its threads. Returns
+// NULL if the pool cannot be set up.
+struct threadpool* tp_create(int nthread, const int* cpus, int ncpu);
+
+// Wait for all submitted tasks, stop the workers and free the pool.
+void tp_destroy(struct threadpool* pool);
+
+// Queue `func(arg)`. Called from a worker it goes to that worker's own
+// deque, otherwise the workers are picked round-robin. Returns NULL if
+// there is no memory for the task.
+struct tp_task* tp_submit(struct threadpool* pool, tp_func_t func, void* arg);
+
+// Like tp_submit, but queue on a specific worker as an affinity hint.
+// Idle workers may still steal it.
+struct tp_task* tp_submit_to(struct threadpool* pool, int worker, tp_func_t func, void* arg);
+
+// Wait for the task to finish, release it and return what it returned.
+// Each task must be waited for exactly once. A worker that waits keeps
+// running other tasks in the meantime.
+void* tp_wait(struct tp_task* task);
+
+// Index of the calling worker in its pool, or -1 outside of any pool.
+int tp_worker_id();
+
+#endif
@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "topology.h"
+
+// Print the discovered topology and the placements, then ping-pong a
+// cache line between two threads bound to CPUs that share an L1/L2, only
+// the last level cache, or no cache at all.
+
+#define DEFAULT_ROUNDS 200000
+
+_Atomic int turn;
+int rounds;
+
+struct player {
+  int cpu;  // -1: not bound
+  int me;
+};
+
+void* play(void* arg) {
+  struct player* p = arg;
+  if (p->cpu >= 0) {
+    cpu_set_t cpu;
+    CPU_ZERO(&cpu);
+    CPU_SET(p->cpu, &cpu);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu);
+  }
+  for (int i = 0; i < rounds; ++i) {
+    for (int spin = 0; turn != p->me; ++spin) {
+      if (spin > 1000) sched_yield();
+    }
+    turn = !p->me;
+  }
+  return NULL;
+}
+
+// Nanoseconds per round trip between the two CPUs.
+double ping_pong(int cpu_a, int cpu_b) {
+  struct player p[2] = {{cpu_a, 0}, {cpu_b, 1}};
+  pthread_t pid[2];
+  struct timeval start, stop;
+  turn = 0;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < 2; ++i) {
+    pthread_create(&pid[i], NULL, play, &p[i]);
+  }
+  for (int i = 0; i < 2; ++i) {
+    pthread_join(pid[i], NULL);
+  }
+  gettimeofday(&stop, NULL);
+  return ((stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_usec - start.tv_usec) * 1e3) / rounds;
+}
+
+void print_placement(const struct cpu_topology* topo, const char* name,
+                     enum placement_policy policy) {
+  int cpus[TOPO_MAX_CPUS];
+  topology_place(topo, policy, topo->ncpu, cpus);
+  printf("%-14s", name);
+  for (int i = 0; i < topo->ncpu; ++i) printf(" %d", cpus[i]);
+  printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+  struct cpu_topology topo;
+  rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+  if (topology_discover(&topo) != 0) {
+    printf("[x] cannot discover the cpu topology\n");
+    return -1;
+  }
+  printf("%d cpus, %d cores, %d packages, %d nodes\n", topo.ncpu, topo.ncore, topo.npackage,
+         topo.nnode);
+  printf("cpu  package  core  smt  node  L1  L2  L3\n");
+  for (int i = 0; i < topo.ncpu; ++i) {
+    const struct cpu_info* c = &topo.cpu[i];
+    printf("%3d  %7d  %4d  %3d  %4d  %2d  %2d  %2d\n", c->cpu, c->package, c->core, c->smt_index,
+           c->node, c->cache_domain[1], c->cache_domain[2], c->cache_domain[3]);
+  }
+  print_placement(&topo, "compact", PLACE_COMPACT);
+  print_placement(&topo, "scatter", PLACE_SCATTER);
+  print_placement(&topo, "one-per-core", PLACE_ONE_PER_CORE);
+
+  // The first CPU pair for every shared cache level; 0 means none shared.
+  int pair[TOPO_MAX_CACHE_LEVEL + 1][2];
+  for (int level = 0; level <= TOPO_MAX_CACHE_LEVEL; ++level) pair[level][0] = -1;
+  for (int i = 0; i < topo.ncpu; ++i) {
+    for (int j = i + 1; j < topo.ncpu; ++j) {
+      int level = topology_shared_cache(&topo, topo.cpu[i].cpu, topo.cpu[j].cpu);
+      if (pair[level][0] == -1) {
+        pair[level][0] = topo.cpu[i].cpu;
+        pair[level][1] = topo.cpu[j].cpu;
+      }
+    }
+  }
+  printf("ping-pong round trip:\n");
+  for (int level = 1; level <= TOPO_MAX_CACHE_LEVEL; ++level) {
+    if (pair[level][0] == -1) continue;
+    printf("  shared L%d  (cpu %d, %d): %10.1f ns\n", level, pair[level][0], pair[level][1],
+           ping_pong(pair[level][0], pair[level][1]));
+  }
+  if (pair[0][0] != -1)
+    printf("  no cache  (cpu %d, %d): %10.1f ns\n", pair[0][0], pair[0][1],
+           ping_pong(pair[0][0], pair[0][1]));
+  printf("  unbound:              %10.1f ns\n", ping_pong(-1, -1));
+  return 0;
+}
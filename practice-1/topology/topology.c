@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+#include "topology.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+static int read_line(const char* path, char* buf, int size) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return -1;
+  char* ok = fgets(buf, size, f);
+  fclose(f);
+  if (ok == NULL) return -1;
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+static int read_int(const char* path, int def) {
+  char buf[64];
+  if (read_line(path, buf, sizeof(buf)) != 0) return def;
+  return atoi(buf);
+}
+
+// Parse a cpulist such as "0-3,8-11" into `set`. Return the lowest CPU in
+// the list, or -1 if it is empty.
+static int parse_cpulist(const char* s, char* set) {
+  int lowest = -1;
+  memset(set, 0, TOPO_MAX_CPUS);
+  while (*s != '\0') {
+    char* end;
+    int lo = strtol(s, &end, 10), hi = lo;
+    if (end == s) break;
+    if (*end == '-') hi = strtol(end + 1, &end, 10);
+    for (int c = lo; c <= hi && c < TOPO_MAX_CPUS; c++) {
+      set[c] = 1;
+    }
+    if (lowest == -1 || lo < lowest) lowest = lo;
+    s = *end == ',' ? end + 1 : end;
+  }
+  return lowest;
+}
+
+static int read_cpulist(const char* path, char* set) {
+  char buf[1024];
+  if (read_line(path, buf, sizeof(buf)) != 0) return -1;
+  return parse_cpulist(buf, set);
+}
+
+static int find_node(int cpu) {
+  char path[128];
+  snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if (dir == NULL) return 0;
+  int node = 0;
+  struct dirent* e;
+  while ((e = readdir(dir)) != NULL) {
+    if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+      node = atoi(e->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+static void read_caches(struct cpu_info* info) {
+  char path[128], buf[64], set[TOPO_MAX_CPUS];
+  for (int level = 0; level <= TOPO_MAX_CACHE_LEVEL; level++) {
+    info->cache_domain[level] = -1;
+  }
+  for (int idx = 0;; idx++) {
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/level", info->cpu, idx);
+    int level = read_int(path, -1);
+    if (level < 0) break;
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/type", info->cpu, idx);
+    if (read_line(path, buf, sizeof(buf)) != 0 || strcmp(buf, "Instruction") == 0) continue;
+    if (level > TOPO_MAX_CACHE_LEVEL) continue;
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", info->cpu, idx);
+    info->cache_domain[level] = read_cpulist(path, set);
+  }
+}
+
+int topology_discover(struct cpu_topology* topo) {
+  char online[TOPO_MAX_CPUS], siblings[TOPO_MAX_CPUS], path[128];
+  int core_leader[TOPO_MAX_CPUS];
+  memset(topo, 0, sizeof(*topo));
+
+  if (read_cpulist(SYSFS_CPU "/online", online) < 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0) return -1;
+    memset(online, 0, sizeof(online));
+    for (int c = 0; c < n && c < TOPO_MAX_CPUS; c++) online[c] = 1;
+  }
+
+  for (int c = 0; c < TOPO_MAX_CPUS; c++) {
+    if (!online[c]) continue;
+    struct cpu_info* info = &topo->cpu[topo->ncpu];
+    info->cpu = c;
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/physical_package_id", c);
+    info->package = read_int(path, 0);
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/thread_siblings_list", c);
+    int leader = read_cpulist(path, siblings);
+    if (leader < 0) {
+      leader = c;
+      memset(siblings, 0, sizeof(siblings));
+      siblings[c] = 1;
+    }
+    info->smt_index = 0;
+    for (int s = 0; s < c; s++) {
+      info->smt_index += siblings[s] && online[s];
+    }
+    core_leader[topo->ncpu] = leader;
+    info->node = find_node(c);
+    read_caches(info);
+    topo->ncpu++;
+  }
+
+  // Number cores, packages and nodes densely, in order of first appearance.
+  for (int i = 0; i < topo->ncpu; i++) {
+    struct cpu_info* info = &topo->cpu[i];
+    int j;
+    for (j = 0; j < i && core_leader[j] != core_leader[i]; j++)
+      ;
+    info->core = j < i ? topo->cpu[j].core : topo->ncore++;
+    for (j = 0; j < i && topo->cpu[j].package != info->package; j++)
+      ;
+    topo->npackage += j == i;
+    for (j = 0; j < i && topo->cpu[j].node != info->node; j++)
+      ;
+    topo->nnode += j == i;
+  }
+  return 0;
+}
+
+const struct cpu_info* topology_find(const struct cpu_topology* topo, int cpu) {
+  for (int i = 0; i < topo->ncpu; i++) {
+    if (topo->cpu[i].cpu == cpu) return &topo->cpu[i];
+  }
+  return NULL;
+}
+
+int topology_shared_cache(const struct cpu_topology* topo, int cpu_a, int cpu_b) {
+  const struct cpu_info *a = topology_find(topo, cpu_a), *b = topology_find(topo, cpu_b);
+  if (a == NULL || b == NULL) return 0;
+  for (int level = 1; level <= TOPO_MAX_CACHE_LEVEL; level++) {
+    if (a->cache_domain[level] != -1 && a->cache_domain[level] == b->cache_domain[level])
+      return level;
+  }
+  return 0;
+}
+
+#define PLACE_KEYS 5
+struct place_key {
+  int k[PLACE_KEYS];
+  int cpu;
+};
+
+static int cmp_place_key(const void* x, const void* y) {
+  const struct place_key *a = x, *b = y;
+  for (int i = 0; i < PLACE_KEYS; i++) {
+    if (a->k[i] != b->k[i]) return a->k[i] < b->k[i] ? -1 : 1;
+  }
+  return a->cpu - b->cpu;
+}
+
+// Id of the largest cache this CPU shares with others.
+static int last_level_domain(const struct cpu_info* info) {
+  for (int level = TOPO_MAX_CACHE_LEVEL; level > 0; level--) {
+    if (info->cache_domain[level] != -1) return info->cache_domain[level];
+  }
+  return info->cpu;
+}
+
+void topology_place(const struct cpu_topology* topo, enum placement_policy policy, int n,
+                    int* cpus) {
+  struct place_key key[TOPO_MAX_CPUS];
+  int nkey = 0;
+  for (int i = 0; i < topo->ncpu; i++) {
+    const struct cpu_info* info = &topo->cpu[i];
+    struct place_key* k = &key[nkey];
+    if (policy == PLACE_ONE_PER_CORE && info->smt_index != 0) continue;
+    k->cpu = info->cpu;
+    if (policy == PLACE_SCATTER) {
+      // The rank of the core within its package interleaves the packages:
+      // first core of every package, then the second core of every one...
+      // It is the number of cores of the package whose first thread comes
+      // before the first thread of this CPU's core, so SMT siblings get
+      // the rank of their own core.
+      int first = 0, core_rank = 0;
+      while (topo->cpu[first].core != info->core) first++;
+      for (int j = 0; j < first; j++) {
+        const struct cpu_info* other = &topo->cpu[j];
+        core_rank += other->package == info->package && other->smt_index == 0;
+      }
+      k->k[0] = info->smt_index;
+      k->k[1] = core_rank;
+      k->k[2] = info->node;
+      k->k[3] = info->package;
+      k->k[4] = 0;
+    } else {
+      k->k[0] = info->node;
+      k->k[1] = info->package;
+      k->k[2] = last_level_domain(info);
+      k->k[3] = info->core;
+      k->k[4] = info->smt_index;
+    }
+    nkey++;
+  }
+  qsort(key, nkey, sizeof(struct place_key), cmp_place_key);
+  for (int i = 0; i < n; i++) {
+    cpus[i] = nkey > 0 ? key[i % nkey].cpu : 0;
+  }
+}
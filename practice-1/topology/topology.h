@@ -0,0 +1,48 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+// CPU topology as reported by /sys/devices/system/cpu, and placement
+// policies that turn it into a list of CPUs to bind threads to. The list
+// can be fed straight to tp_create() or to pthread_attr_setaffinity_np.
+
+#define TOPO_MAX_CPUS 256
+#define TOPO_MAX_CACHE_LEVEL 4
+
+struct cpu_info {
+  int cpu;         // logical CPU number
+  int package;     // physical_package_id
+  int core;        // dense id of the physical core, shared by SMT siblings
+  int smt_index;   // position among the SMT siblings of its core
+  int node;        // NUMA node
+  // cache_domain[level] is the lowest CPU sharing this CPU's unified or
+  // data cache of that level, or -1 if there is no such cache.
+  int cache_domain[TOPO_MAX_CACHE_LEVEL + 1];
+};
+
+struct cpu_topology {
+  int ncpu, ncore, npackage, nnode;
+  struct cpu_info cpu[TOPO_MAX_CPUS];  // online CPUs, ascending
+};
+
+enum placement_policy {
+  PLACE_COMPACT,       // fill SMT siblings, then cores, then caches, then nodes
+  PLACE_SCATTER,       // spread over nodes and packages, siblings last
+  PLACE_ONE_PER_CORE,  // one SMT thread per physical core, compact order
+};
+
+// Fill `topo` from sysfs. Missing entries fall back to one core per CPU
+// in a single package and node. Return 0 on success, -1 if not even the
+// list of online CPUs could be obtained.
+int topology_discover(struct cpu_topology* topo);
+
+// Write the CPUs for `n` threads to `cpus` following `policy`. If there
+// are fewer suitable CPUs than threads the list wraps around.
+void topology_place(const struct cpu_topology* topo, enum placement_policy policy, int n,
+                    int* cpus);
+
+// Lowest cache level shared by two CPUs, or 0 if they share none.
+int topology_shared_cache(const struct cpu_topology* topo, int cpu_a, int cpu_b);
+
+const struct cpu_info* topology_find(const struct cpu_topology* topo, int cpu);
+
+#endif
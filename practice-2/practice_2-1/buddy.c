@@ -1,174 +1,1461 @@
+#define _GNU_SOURCE
 #include "buddy.h"
 
 #include <assert.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
-#define MAX_PAGE_NUM (1 << ((MAX_RANK)-1))
+#include "spinlock.h"
 
-struct tree_node {
-  uint8_t *p;
-  int is_allocated;
-  struct tree_node *next;
-  struct tree_node *prev;
-} node[MAX_PAGE_NUM * 2];
+#define PAGE_SHIFT 12
 
-struct node_list {
-  struct tree_node *head;
+// A zone is one contiguous run of pages handed to init_page() or
+// add_zone(). Pages are numbered from the start of their zone (pfn), and
+// a block of rank r starts at a pfn that is a multiple of 2^(r-1), so its
+// buddy is at pfn ^ 2^(r-1). Any page count works: a block whose buddy
+// would stick out of the zone simply never merges, which carves the tail
+// of the zone into smaller maximal buddy trees.
+struct zone {
+  uint8_t *start;
+  int pg_num;
+  // free_bitmap[r - 1] has one bit per block of rank r, indexed by
+  // pfn >> (r - 1). A bit is set iff that block is free and on its list.
+  // Every level has words of its own, so the rank lock covers them.
+  uint64_t *free_bitmap[MAX_RANK];
+  // Only the first page of a block is recorded in the rank_of_page array:
+  // its rank if the block is allocated (| PAGE_UNMOVABLE unless it is of
+  // MIGRATE_MOVABLE), its rank | PAGE_FREE if it is free (on a list or in
+  // a per-CPU cache), or rank | PAGE_HELD while compaction holds it.
+  // Every other page is -1. This
+  // answers query_ranks() without a scan, and also helps to check whether
+  // a page address is valid (i.e. whether it is previously returned by
+  // alloc_pages() and not yet freed by return_pages()).
+  int8_t *rank_of_page;
+  // Migrate type of each pageblock, i.e. of each aligned run of
+  // 2^(PAGEBLOCK_RANK - 1) pages. A free block goes on the list of the
+  // type of the pageblock it starts in.
+  uint8_t *pageblock_type;
+  void *meta;  // the allocation backing the arrays above, if it is ours
+};
+#define PAGE_RANK 0x1f
+#define PAGE_UNMOVABLE 0x20
+#define PAGE_FREE 0x40
+#define PAGE_HELD (PAGE_FREE | PAGE_UNMOVABLE)
+
+// A free block keeps its free list links in its own first page, so the
+// only per-block metadata outside of the pool is one bit.
+struct free_block {
+  struct free_block *next;
+  struct free_block *prev;
+  struct zone *zone;
+  int type;      // the list it is on
+  int released;  // all pages but this one were given back to the OS
+};
+
+// Each rank has its own lock, which guards its list, its count and the
+// bits of its tree level. Splits and merges lock one rank at a time while
+// they move down or up the tree, so no two rank locks are ever held at
+// once. A block being split or merged is owned by that thread and is on
+// no list; it counts as in flight meanwhile (see flight_begin()), and an
+// allocation that finds nothing while blocks are in flight looks again.
+// The lists hold blocks of all zones, one list per migrate type.
+struct free_area {
+  volatile int lock;
+  struct free_block *head[MIGRATE_TYPES];
   size_t size;
+} __attribute__((aligned(64)));
+
+// Where to steal from when a type has run out, as in Linux.
+static const int fallbacks[MIGRATE_TYPES][MIGRATE_TYPES - 1] = {
+    [MIGRATE_UNMOVABLE] = {MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE},
+    [MIGRATE_MOVABLE] = {MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE},
+    [MIGRATE_RECLAIMABLE] = {MIGRATE_UNMOVABLE, MIGRATE_MOVABLE},
 };
-struct node_list free_list[MAX_RANK];
-// When a range of pages is allocated, only the first page is recorded
-// in the rank_of_page array, and the other pages are marked as -1.
-// This is used in the query_ranks() function, and also helps to check
-// whether a page address is valid (i.e. whether it is previously
-// returned by alloc_pages() and not yet freed by return_pages()).
-int rank_of_page[MAX_PAGE_NUM];
 
-uint8_t *mem_start;
-int pg_num, max_rank, max_page_num;
+// Per-CPU caches of free movable blocks of rank 1..PCP_MAX_RANK, refilled
+// from and drained to the buddy core in batches, so that most small
+// allocations only touch their own CPU's lock. Blocks in a cache are
+// allocated as far as the buddy core is concerned.
+#define PCP_MAX_CPUS 64
+struct per_cpu_pages {
+  volatile int lock;
+  int count[PCP_MAX_RANK];
+  struct free_block *list[PCP_MAX_RANK];
+} __attribute__((aligned(64)));
 
-int init_page(void *p, int pgcount) {
-  mem_start = p;
-  pg_num = pgcount;
-  // printf("mem_start %p, pg_num %d\n", mem_start, pg_num);
-  max_rank = 0;
-  while (1 << max_rank <= pg_num && max_rank < MAX_RANK) {
-    max_rank++;
-  }
-  max_page_num = 1 << (max_rank - 1);  // size = 2^(rank-1)
-  for (int i = 0; i < max_rank; i++) {
-    free_list[i].head = NULL;
-    free_list[i].size = 0;
-    int start = 1 << (max_rank - 1 - i), end = start << 1;
-    int addr_incr = 1 << (i + 12);  // page size = 4KB
-    uint8_t *p = mem_start;
-    for (int j = start; j < end; j++) {
-      // printf("rank %d, start %d, end %d, j %d\n", i, start, end, j);
-      node[j].p = p;
-      node[j].is_allocated = 0;
-      node[j].next = NULL;
-      node[j].prev = NULL;
-      p += addr_incr;
-    }
-  }
-  // assert(node[1].p == mem_start);
-  // assert(node[1].is_allocated == 0);
-  // assert(node[1].next == NULL);
-  // assert(node[1].prev == NULL);
-  free_list[max_rank - 1].head = &node[1];
-  free_list[max_rank - 1].size = 1;
-  return OK;
+// Everything about one pool: its zones, free lists, caches and settings.
+// The pool of init_page() and the calls without a pool argument is
+// default_pool; buddy_pool_create() places others in the metadata region
+// it is given.
+struct buddy_pool {
+  struct free_area free_area[MAX_RANK];
+  // Bit (rank - 1) of free_area_mask[type] is set iff the list of `type`
+  // in free_area[rank - 1] is not empty, so the smallest usable rank is
+  // found with a single count-trailing-zeros. Written under the rank's
+  // lock, read without it.
+  uint32_t free_area_mask[MIGRATE_TYPES];
+  struct zone zones[MAX_ZONES];
+  int nr_zones;
+
+  // Splits and merges that have blocks off the lists right now, and the
+  // number of them that ever finished.
+  int in_flight;
+  unsigned long flights_done;
+
+  // Scavenging: free blocks of rank >= scavenge_rank are given back to
+  // the OS with scavenge_advice, except for their first page, once more
+  // than scavenge_keep free pages are resident. 0 disables.
+  // released_pages counts the pages of free blocks given back and not
+  // touched since.
+  int scavenge_rank, scavenge_advice;
+  long scavenge_keep;
+  volatile int scavenge_lock;
+  long released_pages;
+
+  // Lazy coalescing: blocks of rank <= lazy_rank are put on their free
+  // list without merging, so that an alloc/free ping-pong does not split
+  // and merge the same blocks over and over. Their buddies are merged by
+  // a pass over those lists once lazy_threshold blocks were freed that
+  // way, or when an allocation fails. 0 disables.
+  int lazy_rank, lazy_threshold;
+  int lazy_frees;  // freed without merging since the last pass
+  volatile int lazy_lock;
+
+  // PCP_MAX_CPUS caches, allocated by the first buddy_pcp_setup() that
+  // enables them; NULL until then, and always in the other pools.
+  struct per_cpu_pages *pcp;
+  // An empty cache is refilled to pcp_low blocks; a cache holding more
+  // than pcp_high blocks is drained back down to pcp_low. 0 disables.
+  int pcp_low, pcp_high;
+
+  // Compaction, see compact(pool).
+  relocate_fn relocate;
+  void *relocate_arg;
+  volatile int compact_lock;
+  struct compact_stats compact_stats;
+};
+struct buddy_pool default_pool;
+
+// Statistics and tracing hooks. They expand to nothing unless the file is
+// built with -DBUDDY_STATS or -DBUDDY_TRACE.
+#if defined(BUDDY_STATS) || defined(BUDDY_TRACE)
+static inline long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+#endif
+
+#ifdef BUDDY_STATS
+struct buddy_stats buddy_stats;
+#define stat_add(field, rank, n) \
+  __atomic_fetch_add(&buddy_stats.field[(rank) - 1], (n), __ATOMIC_RELAXED)
+#define stat_start(t) long t = now_ns()
+static void stat_latency(long start) {
+  long ns = now_ns() - start;
+  int bucket = ns > 1 ? 63 - __builtin_clzl(ns) : 0;
+  if (bucket >= BUDDY_LATENCY_BUCKETS) bucket = BUDDY_LATENCY_BUCKETS - 1;
+  __atomic_fetch_add(&buddy_stats.latency[bucket], 1, __ATOMIC_RELAXED);
+}
+#else
+#define stat_add(field, rank, n) ((void)0)
+#define stat_start(t)
+#define stat_latency(start) ((void)0)
+#endif
+#define stat_inc(field, rank) stat_add(field, rank, 1)
+
+#ifdef BUDDY_TRACE
+// A slot's seq is 0 while it is being written and the event's number
+// after, so a reader can tell a torn or overwritten slot from a good one.
+struct buddy_event trace_ring[BUDDY_TRACE_SIZE];
+unsigned long trace_head;  // events recorded so far
+static void trace_event(int type, int rank, void *addr) {
+  unsigned long seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED) + 1;
+  struct buddy_event *e = &trace_ring[(seq - 1) % BUDDY_TRACE_SIZE];
+  __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e->nsec = now_ns();
+  e->addr = addr;
+  e->type = type;
+  e->rank = rank;
+  __atomic_store_n(&e->seq, seq, __ATOMIC_RELEASE);
 }
+#else
+#define trace_event(type, rank, addr) ((void)0)
+#endif
 
-void *alloc_pages(int rank) {
-  int i = rank;
-  struct tree_node *n = free_list[i - 1].head;
-  while (n == NULL) {
-    i++;
-    // printf("alloc pages, i %d, rank %d\n", i, rank);
-    if (i > max_rank) {
-      return (void *)-ENOSPC;
+static inline int test_block(struct zone *z, int pfn, int rank) {
+  int idx = pfn >> (rank - 1);
+  return (z->free_bitmap[rank - 1][idx >> 6] >> (idx & 63)) & 1;
+}
+static inline void set_block(struct zone *z, int pfn, int rank) {
+  int idx = pfn >> (rank - 1);
+  z->free_bitmap[rank - 1][idx >> 6] |= 1ULL << (idx & 63);
+}
+static inline void clear_block(struct zone *z, int pfn, int rank) {
+  int idx = pfn >> (rank - 1);
+  z->free_bitmap[rank - 1][idx >> 6] &= ~(1ULL << (idx & 63));
+}
+
+static inline struct free_block *block_of(struct zone *z, int pfn) {
+  return (struct free_block *)(z->start + ((size_t)pfn << PAGE_SHIFT));
+}
+
+static inline int pfn_of(struct zone *z, void *p) { return ((uint8_t *)p - z->start) >> PAGE_SHIFT; }
+
+// The zone containing `p`, or NULL.
+static struct zone *zone_of(struct buddy_pool *pool, void *p) {
+  for (int i = 0; i < pool->nr_zones; i++) {
+    struct zone *z = &pool->zones[i];
+    if ((uint8_t *)p >= z->start && (uint8_t *)p < z->start + ((size_t)z->pg_num << PAGE_SHIFT))
+      return z;
+  }
+  return NULL;
+}
+
+static inline int pageblock_of(int pfn) { return pfn >> (PAGEBLOCK_RANK - 1); }
+
+// Record that the free block at `pfn` has its pages after the first one
+// given back. The rank's lock is held.
+static void mark_released(struct buddy_pool *pool, struct zone *z, int pfn, int rank) {
+  block_of(z, pfn)->released = 1;
+  __atomic_fetch_add(&pool->released_pages, (1L << (rank - 1)) - 1, __ATOMIC_RELAXED);
+}
+
+static void push_free(struct buddy_pool *pool, struct zone *z, int pfn, int rank) {
+  struct free_area *area = &pool->free_area[rank - 1];
+  struct free_block *b = block_of(z, pfn);
+  int type = z->pageblock_type[pageblock_of(pfn)];
+  b->zone = z;
+  b->type = type;
+  b->released = 0;
+  b->prev = NULL;
+  b->next = area->head[type];
+  if (area->head[type] != NULL) area->head[type]->prev = b;
+  area->head[type] = b;
+  area->size++;
+  set_block(z, pfn, rank);
+  z->rank_of_page[pfn] = rank | PAGE_FREE;
+  __atomic_fetch_or(&pool->free_area_mask[type], 1u << (rank - 1), __ATOMIC_RELAXED);
+}
+
+static void remove_free(struct buddy_pool *pool, struct zone *z, int pfn, int rank) {
+  struct free_area *area = &pool->free_area[rank - 1];
+  struct free_block *b = block_of(z, pfn);
+  if (b->prev != NULL) {
+    b->prev->next = b->next;
+  } else {
+    area->head[b->type] = b->next;
+  }
+  if (b->next != NULL) b->next->prev = b->prev;
+  area->size--;
+  clear_block(z, pfn, rank);
+  z->rank_of_page[pfn] = -1;
+  if (b->released)
+    __atomic_fetch_sub(&pool->released_pages, (1L << (rank - 1)) - 1, __ATOMIC_RELAXED);
+  if (area->head[b->type] == NULL)
+    __atomic_fetch_and(&pool->free_area_mask[b->type], ~(1u << (rank - 1)), __ATOMIC_RELAXED);
+}
+
+// Blocks taken off the lists to be split or merged are in flight until
+// their pieces are back. An allocation that finds nothing rescans unless
+// flights_settled() says that no block was in flight while it looked.
+static inline void flight_begin(struct buddy_pool *pool) {
+  __atomic_fetch_add(&pool->in_flight, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void flight_end(struct buddy_pool *pool) {
+  __atomic_fetch_add(&pool->flights_done, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_sub(&pool->in_flight, 1, __ATOMIC_SEQ_CST);
+}
+
+// Whether no split or merge is under way and none finished since
+// flights_done was `done`.
+static inline int flights_settled(struct buddy_pool *pool, unsigned long done) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&pool->in_flight, __ATOMIC_SEQ_CST) == 0 &&
+         __atomic_load_n(&pool->flights_done, __ATOMIC_SEQ_CST) == done;
+}
+
+static void release_zones(struct buddy_pool *pool) {
+  for (int i = 0; i < pool->nr_zones; i++) {
+    free(pool->zones[i].meta);
+  }
+  pool->nr_zones = 0;
+}
+
+// Bytes of bitmaps, rank_of_page and pageblock_type of a zone.
+static size_t zone_meta_size(int pgcount) {
+  size_t total = 0;
+  for (int rank = 1; rank <= MAX_RANK; rank++) {
+    total += (((size_t)pgcount >> (rank - 1)) + 64) / 64 * sizeof(uint64_t);
+  }
+  return total + pgcount + pageblock_of(pgcount - 1) + 1;
+}
+
+// Add a zone to `pool`, with its arrays in `meta` (zone_meta_size() bytes,
+// 8-byte aligned), or in memory of its own if meta is NULL.
+static int __add_zone(struct buddy_pool *pool, void *p, int pgcount, void *meta) {
+  if (p == NULL || pgcount <= 0 || pool->nr_zones == MAX_ZONES) return -EINVAL;
+  uint8_t *start = p, *end = start + ((size_t)pgcount << PAGE_SHIFT);
+  for (int i = 0; i < pool->nr_zones; i++) {
+    uint8_t *zs = pool->zones[i].start, *ze = zs + ((size_t)pool->zones[i].pg_num << PAGE_SHIFT);
+    if (start < ze && zs < end) return -EINVAL;
+  }
+
+  struct zone *z = &pool->zones[pool->nr_zones];
+  z->meta = NULL;
+  if (meta == NULL) {
+    meta = z->meta = calloc(1, zone_meta_size(pgcount));
+    if (meta == NULL) return -ENOMEM;
+  } else {
+    memset(meta, 0, zone_meta_size(pgcount));
+  }
+  z->start = start;
+  z->pg_num = pgcount;
+  uint64_t *words = meta;
+  for (int rank = 1; rank <= MAX_RANK; rank++) {
+    z->free_bitmap[rank - 1] = words;
+    words += (((size_t)pgcount >> (rank - 1)) + 64) / 64;
+  }
+  z->rank_of_page = (int8_t *)words;
+  memset(z->rank_of_page, -1, pgcount);
+  z->pageblock_type = (uint8_t *)z->rank_of_page + pgcount;
+  memset(z->pageblock_type, MIGRATE_MOVABLE, pageblock_of(pgcount - 1) + 1);
+
+  // Carve the zone into maximal aligned blocks: as many MAX_RANK blocks
+  // as fit, then one block per set bit of the remainder. They are pushed
+  // from the end so that the lowest address is handed out first.
+  int pfn = pgcount;
+  for (int rank = 1; rank <= MAX_RANK; rank++) {
+    int size = 1 << (rank - 1);
+    while ((rank < MAX_RANK && (pgcount & size)) || (rank == MAX_RANK && pfn > 0)) {
+      pfn -= size;
+      spin_lock(&pool->free_area[rank - 1].lock);
+      push_free(pool, z, pfn, rank);
+      spin_unlock(&pool->free_area[rank - 1].lock);
+      if (rank < MAX_RANK) break;
     }
-    n = free_list[i - 1].head;
   }
+  pool->nr_zones++;
+  return OK;
+}
 
-  // remove from free list
-  // assert(n->prev == NULL);
-  if (n->next != NULL) n->next->prev = NULL;
-  free_list[i - 1].head = n->next;
-  free_list[i - 1].size--;
-  n->next = NULL;
+int add_zone(void *p, int pgcount) { return __add_zone(&default_pool, p, pgcount, NULL); }
 
-  // i > rank, split a larger block
-  while (i > rank) {
-    n->is_allocated = 1;
+int init_page(void *p, int pgcount) {
+  struct buddy_pool *pool = &default_pool;
+  release_zones(pool);
+  memset(pool->free_area, 0, sizeof(pool->free_area));
+  memset(pool->free_area_mask, 0, sizeof(pool->free_area_mask));
+  pool->released_pages = 0;
+  pool->lazy_frees = 0;
+  if (pool->pcp != NULL) memset(pool->pcp, 0, sizeof(struct per_cpu_pages) * PCP_MAX_CPUS);
+  return add_zone(p, pgcount);
+}
+
+size_t buddy_pool_meta_size(int pgcount) {
+  if (pgcount <= 0) return 0;
+  // Room to align the pool to its cache lines.
+  return sizeof(struct buddy_pool) + 63 + zone_meta_size(pgcount);
+}
+
+struct buddy_pool *buddy_pool_create(void *p, int pgcount, void *meta) {
+  if (p == NULL || pgcount <= 0) return ERR_PTR(-EINVAL);
+  size_t len = (size_t)pgcount << PAGE_SHIFT;
+  if (meta == NULL) {
+    // The last pages of the pool hold the metadata and are not handed out.
+    int meta_pages = (buddy_pool_meta_size(pgcount) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if (meta_pages >= pgcount) return ERR_PTR(-ENOMEM);
+    pgcount -= meta_pages;
+    meta = (uint8_t *)p + ((size_t)pgcount << PAGE_SHIFT);
+  } else if ((uint8_t *)meta < (uint8_t *)p + len &&
+             (uint8_t *)p < (uint8_t *)meta + buddy_pool_meta_size(pgcount)) {
+    return ERR_PTR(-EINVAL);
+  }
+  struct buddy_pool *pool = (struct buddy_pool *)(((uintptr_t)meta + 63) & ~(uintptr_t)63);
+  memset(pool, 0, sizeof(*pool));
+  int ret = __add_zone(pool, p, pgcount, pool + 1);
+  return ret == OK ? pool : ERR_PTR(ret);
+}
+
+void buddy_pool_destroy(struct buddy_pool *pool) {
+  if (pool != NULL) release_zones(pool);
+}
+
+// Split a block of rank `i` that is on no list down to `want`, and keep
+// the left part.
+static void split_block(struct buddy_pool *pool, struct zone *z, int pfn, int i, int want) {
+  // The halves put back keep what was released of them.
+  int released = block_of(z, pfn)->released;
+  while (i > want) {
+    stat_inc(splits, i);
+    trace_event(BUDDY_EV_SPLIT, i, block_of(z, pfn));
     i--;
-    // in this case, free_list[i - 1] must be empty
-    // assert(free_list[i - 1].head == NULL);
-    int node_idx = n - node;
-    struct tree_node *rc = &node[(node_idx << 1) | 1];  // right child
-    // assert(rc->is_allocated == 0);
-    // assert(rc->next == NULL);
-    // assert(rc->prev == NULL);
-    free_list[i - 1].head = rc;
-    free_list[i - 1].size = 1;
-    n = &node[node_idx << 1];  // left child
-  }
-  // printf("node idx %ld\n", n - node);
-  n->is_allocated = 1;
-  rank_of_page[((uint8_t *)n->p - mem_start) >> 12] = rank;
-  // printf("alloc_pages: rank %d, p %p\n", rank, n->p);
-  return n->p;
-}
-
-int return_pages(void *p) {
-  int page_idx = ((uint8_t *)p - mem_start) >> 12;
-  if (page_idx < 0 || page_idx >= max_page_num) {
+    spin_lock(&pool->free_area[i - 1].lock);
+    push_free(pool, z, pfn + (1 << (i - 1)), i);
+    if (released) mark_released(pool, z, pfn + (1 << (i - 1)), i);
+    spin_unlock(&pool->free_area[i - 1].lock);
+  }
+}
+
+// Largest rank >= `rank` with a free block on the list of a fallback of
+// `type`, or 0. The type found is stored in *from.
+static int find_fallback(struct buddy_pool *pool, int rank, int type, int *from) {
+  for (int k = 0; k < MIGRATE_TYPES - 1; k++) {
+    int f = fallbacks[type][k];
+    uint32_t mask =
+        __atomic_load_n(&pool->free_area_mask[f], __ATOMIC_RELAXED) & ~((1u << (rank - 1)) - 1);
+    if (mask != 0) {
+      *from = f;
+      return 32 - __builtin_clz(mask);
+    }
+  }
+  return 0;
+}
+
+// Hand the pageblock containing `pfn` over to `type`, and move the free
+// blocks inside it to the lists of `type`.
+static void claim_pageblock(struct buddy_pool *pool, struct zone *z, int pfn, int type) {
+  int first = pageblock_of(pfn) << (PAGEBLOCK_RANK - 1);
+  int last = first + (1 << (PAGEBLOCK_RANK - 1));
+  if (last > z->pg_num) last = z->pg_num;
+  z->pageblock_type[pageblock_of(pfn)] = type;
+  for (int rank = 1; rank < PAGEBLOCK_RANK; rank++) {
+    spin_lock(&pool->free_area[rank - 1].lock);
+    for (int b = first; b + (1 << (rank - 1)) <= last; b += 1 << (rank - 1)) {
+      if (test_block(z, b, rank) && block_of(z, b)->type != type) {
+        int released = block_of(z, b)->released;
+        remove_free(pool, z, b, rank);
+        push_free(pool, z, b, rank);
+        if (released) mark_released(pool, z, b, rank);
+      }
+    }
+    spin_unlock(&pool->free_area[rank - 1].lock);
+  }
+}
+
+// Take a free block of rank `want` and `type` out of the buddy core,
+// splitting a larger one if needed. If there is none, take the largest
+// free block of a rank in [rank, want) instead. If `type` has nothing
+// left, steal the largest block that a fallback type has. The rank taken
+// is stored in *got.
+static struct free_block *__alloc_block(struct buddy_pool *pool, int rank, int want, int type,
+                                        int *got) {
+  struct free_block *b;
+  int i, from;
+  for (;;) {
+    unsigned long done = __atomic_load_n(&pool->flights_done, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t mask = __atomic_load_n(&pool->free_area_mask[type], __ATOMIC_RELAXED);
+    uint32_t avail = mask >> (want - 1);
+    uint32_t smaller = mask & ((1u << (want - 1)) - 1) & ~((1u << (rank - 1)) - 1);
+    from = type;
+    if (avail != 0) {
+      i = want + __builtin_ctz(avail);
+    } else if (smaller != 0) {
+      i = 32 - __builtin_clz(smaller);
+      want = i;
+    } else {
+      i = find_fallback(pool, rank, type, &from);
+      if (i == 0) {
+        if (flights_settled(pool, done)) return NULL;
+        // What we need may be in the middle of a split or merge.
+        sched_yield();
+        continue;
+      }
+      if (want > i) want = i;
+    }
+    spin_lock(&pool->free_area[i - 1].lock);
+    b = pool->free_area[i - 1].head[from];
+    if (b != NULL) break;
+    // Someone emptied the list after we read the mask; look again.
+    spin_unlock(&pool->free_area[i - 1].lock);
+  }
+  struct zone *z = b->zone;
+  int pfn = pfn_of(z, b), split = i != want || from != type;
+  if (split) flight_begin(pool);
+  remove_free(pool, z, pfn, i);
+  spin_unlock(&pool->free_area[i - 1].lock);
+
+  if (from != type) {
+    // Stealing. A block of a pageblock or more is first cut down to the
+    // pageblocks needed, which are then taken over. A smaller block takes
+    // its whole pageblock along if it is large, or if the thief is not
+    // movable, so that the next allocations of its type come from the
+    // same place instead of stealing again elsewhere.
+    int keep = want > PAGEBLOCK_RANK ? want : PAGEBLOCK_RANK;
+    if (i >= keep) {
+      split_block(pool, z, pfn, i, keep);
+      i = keep;
+      memset(&z->pageblock_type[pageblock_of(pfn)], type, 1 << (i - PAGEBLOCK_RANK));
+    } else if (type != MIGRATE_MOVABLE || i - 1 >= (PAGEBLOCK_RANK - 1) / 2) {
+      claim_pageblock(pool, z, pfn, type);
+    }
+  }
+
+  split_block(pool, z, pfn, i, want);
+  if (want >= PAGEBLOCK_RANK) {
+    memset(&z->pageblock_type[pageblock_of(pfn)], type, 1 << (want - PAGEBLOCK_RANK));
+  }
+  if (split) flight_end(pool);
+  *got = want;
+  return b;
+}
+
+// Take a free block of `rank` out of the buddy core.
+static struct free_block *__alloc_pages(struct buddy_pool *pool, int rank, int type) {
+  int got;
+  return __alloc_block(pool, rank, rank, type, &got);
+}
+
+static void __return_pages(struct buddy_pool *pool, struct zone *z, int pfn, int rank);
+
+// Put back a block that scavenge() took off its list. A buddy freed in
+// the meantime could not merge with it, so merge it now if there is one;
+// the merged block then counts as resident again.
+static void put_back_released(struct buddy_pool *pool, struct zone *z, int pfn, int rank) {
+  int buddy = pfn ^ (1 << (rank - 1));
+  spin_lock(&pool->free_area[rank - 1].lock);
+  if (rank == MAX_RANK || buddy + (1 << (rank - 1)) > z->pg_num || !test_block(z, buddy, rank)) {
+    push_free(pool, z, pfn, rank);
+    mark_released(pool, z, pfn, rank);
+    spin_unlock(&pool->free_area[rank - 1].lock);
+    return;
+  }
+  spin_unlock(&pool->free_area[rank - 1].lock);
+  z->rank_of_page[pfn] = -1;
+  __return_pages(pool, z, pfn, rank);
+}
+
+// Release every free block of rank >= min_rank that is not released yet,
+// and return the number of pages released. scavenge_lock is held. The
+// blocks are taken off their lists, like the blocks in a per-CPU cache,
+// so that madvise() runs without the rank lock and nobody allocates them
+// meanwhile.
+static long scavenge(struct buddy_pool *pool, int min_rank) {
+  long count = 0;
+  for (int rank = MAX_RANK; rank >= min_rank; rank--) {
+    size_t bytes = ((size_t)PAGE_SIZE << (rank - 1)) - PAGE_SIZE;
+    struct free_block *held = NULL, *next;
+    flight_begin(pool);
+    spin_lock(&pool->free_area[rank - 1].lock);
+    for (int type = 0; type < MIGRATE_TYPES; type++) {
+      for (struct free_block *b = pool->free_area[rank - 1].head[type]; b != NULL; b = next) {
+        next = b->next;
+        if (b->released) continue;
+        int pfn = pfn_of(b->zone, b);
+        remove_free(pool, b->zone, pfn, rank);
+        b->zone->rank_of_page[pfn] = rank | PAGE_FREE;
+        b->next = held;
+        held = b;
+      }
+    }
+    spin_unlock(&pool->free_area[rank - 1].lock);
+    for (struct free_block *b = held; b != NULL; b = next) {
+      next = b->next;
+      // The first page holds the links, keep it.
+      madvise((uint8_t *)b + PAGE_SIZE, bytes, pool->scavenge_advice);
+      put_back_released(pool, b->zone, pfn_of(b->zone, b), rank);
+      count += (1L << (rank - 1)) - 1;
+    }
+    flight_end(pool);
+  }
+  return count;
+}
+
+static long free_pages(struct buddy_pool *pool) {
+  long count = 0;
+  for (int rank = 1; rank <= MAX_RANK; rank++) {
+    count += (long)__atomic_load_n(&pool->free_area[rank - 1].size, __ATOMIC_RELAXED) << (rank - 1);
+  }
+  return count;
+}
+
+// Scavenge if too much free memory is resident, unless someone else is.
+static void maybe_scavenge(struct buddy_pool *pool) {
+  long resident = free_pages(pool) - __atomic_load_n(&pool->released_pages, __ATOMIC_RELAXED);
+  if (resident <= pool->scavenge_keep) return;
+  if (__atomic_exchange_n(&pool->scavenge_lock, 1, __ATOMIC_ACQUIRE)) return;
+  // Scavenging may have been turned off since the caller looked.
+  int rank = pool->scavenge_rank;
+  if (rank > 0) scavenge(pool, rank);
+  spin_unlock(&pool->scavenge_lock);
+}
+
+// Give a block back to the buddy core and merge it.
+static void __return_pages(struct buddy_pool *pool, struct zone *z, int pfn, int rank) {
+  // recursively merge with buddy. Whoever frees the second of two buddies
+  // takes the rank lock after the first one did, and sees its bit.
+  int merging = 0;
+  for (;;) {
+    spin_lock(&pool->free_area[rank - 1].lock);
+    int buddy = pfn ^ (1 << (rank - 1));
+    if (rank == MAX_RANK || buddy + (1 << (rank - 1)) > z->pg_num || !test_block(z, buddy, rank))
+      break;
+    if (!merging) flight_begin(pool);
+    merging = 1;
+    remove_free(pool, z, buddy, rank);
+    spin_unlock(&pool->free_area[rank - 1].lock);
+    pfn &= ~(1 << (rank - 1));
+    stat_inc(merges, rank);
+    trace_event(BUDDY_EV_MERGE, rank, block_of(z, pfn));
+    rank++;
+  }
+  push_free(pool, z, pfn, rank);
+  spin_unlock(&pool->free_area[rank - 1].lock);
+  if (merging) flight_end(pool);
+  if (pool->scavenge_rank > 0 && rank >= pool->scavenge_rank) maybe_scavenge(pool);
+}
+
+// Merge every free block of rank <= max_rank whose buddy is free too.
+static void coalesce(struct buddy_pool *pool, int max_rank) {
+  spin_lock(&pool->lazy_lock);
+  __atomic_store_n(&pool->lazy_frees, 0, __ATOMIC_RELAXED);
+  for (int rank = 1; rank <= max_rank; rank++) {
+    // Take one block of each free pair off its list, then hand it to
+    // __return_pages(pool), which finds the other one and merges upward.
+    struct free_block *pairs = NULL;
+    flight_begin(pool);
+    spin_lock(&pool->free_area[rank - 1].lock);
+    for (int type = 0; type < MIGRATE_TYPES; type++) {
+      struct free_block *b = pool->free_area[rank - 1].head[type], *next;
+      for (; b != NULL; b = next) {
+        next = b->next;
+        struct zone *z = b->zone;
+        int pfn = pfn_of(z, b), buddy = pfn ^ (1 << (rank - 1));
+        if (buddy + (1 << (rank - 1)) > z->pg_num || !test_block(z, buddy, rank)) continue;
+        if (next == block_of(z, buddy)) next = next->next;
+        remove_free(pool, z, pfn, rank);
+        b->next = pairs;
+        pairs = b;
+      }
+    }
+    spin_unlock(&pool->free_area[rank - 1].lock);
+    while (pairs != NULL) {
+      struct free_block *b = pairs;
+      pairs = b->next;
+      __return_pages(pool, b->zone, pfn_of(b->zone, b), rank);
+    }
+    flight_end(pool);
+  }
+  spin_unlock(&pool->lazy_lock);
+}
+
+static void lazy_return_pages(struct buddy_pool *pool, struct zone *z, int pfn, int rank) {
+  spin_lock(&pool->free_area[rank - 1].lock);
+  push_free(pool, z, pfn, rank);
+  spin_unlock(&pool->free_area[rank - 1].lock);
+  if (__atomic_add_fetch(&pool->lazy_frees, 1, __ATOMIC_RELAXED) == pool->lazy_threshold)
+    coalesce(pool, pool->lazy_rank);
+}
+
+static inline int8_t alloc_mark(int rank, int type) {
+  return type == MIGRATE_MOVABLE ? rank : rank | PAGE_UNMOVABLE;
+}
+
+static void *alloc_from_core(struct buddy_pool *pool, int rank, int type) {
+  struct free_block *b = __alloc_pages(pool, rank, type);
+  if (b != NULL) b->zone->rank_of_page[pfn_of(b->zone, b)] = alloc_mark(rank, type);
+  return b;
+}
+
+static inline struct per_cpu_pages *this_cpu_pages(struct buddy_pool *pool) {
+  int cpu = sched_getcpu();
+  return &pool->pcp[(cpu < 0 ? 0 : cpu) % PCP_MAX_CPUS];
+}
+
+static inline void pcp_push(struct per_cpu_pages *cache, struct zone *z, int pfn, int rank) {
+  struct free_block *b = block_of(z, pfn);
+  b->zone = z;
+  z->rank_of_page[pfn] = rank | PAGE_FREE;
+  b->next = cache->list[rank - 1];
+  cache->list[rank - 1] = b;
+  cache->count[rank - 1]++;
+}
+
+// Give the cached blocks of `rank` beyond `keep` back to the core, all
+// under one hold of the rank lock. A block whose buddy is free is merged
+// with it there, and only the merged blocks go on up one by one.
+static void pcp_drain(struct buddy_pool *pool, struct per_cpu_pages *cache, int rank, int keep) {
+  struct free_block *merged = NULL, *b;
+  flight_begin(pool);
+  spin_lock(&pool->free_area[rank - 1].lock);
+  while (cache->count[rank - 1] > keep) {
+    b = cache->list[rank - 1];
+    cache->list[rank - 1] = b->next;
+    cache->count[rank - 1]--;
+    struct zone *z = b->zone;
+    int pfn = pfn_of(z, b), buddy = pfn ^ (1 << (rank - 1));
+    z->rank_of_page[pfn] = -1;
+    if (rank == MAX_RANK || buddy + (1 << (rank - 1)) > z->pg_num || !test_block(z, buddy, rank)) {
+      push_free(pool, z, pfn, rank);
+      continue;
+    }
+    remove_free(pool, z, buddy, rank);
+    pfn &= ~(1 << (rank - 1));
+    stat_inc(merges, rank);
+    trace_event(BUDDY_EV_MERGE, rank, block_of(z, pfn));
+    b = block_of(z, pfn);
+    b->zone = z;
+    b->next = merged;
+    merged = b;
+  }
+  spin_unlock(&pool->free_area[rank - 1].lock);
+  while (merged != NULL) {
+    b = merged;
+    merged = b->next;
+    __return_pages(pool, b->zone, pfn_of(b->zone, b), rank + 1);
+  }
+  flight_end(pool);
+  if (pool->scavenge_rank > 0 && rank >= pool->scavenge_rank) maybe_scavenge(pool);
+}
+
+// Fill `cache` up to pcp_low blocks of `rank`: first with what the rank's
+// movable list has, under one hold of its lock, then with the children of
+// a block of rank + log2(missing blocks), taken from the core in one go.
+static void pcp_refill(struct buddy_pool *pool, struct per_cpu_pages *cache, int rank) {
+  struct free_area *area = &pool->free_area[rank - 1];
+  struct free_block *b;
+  spin_lock(&area->lock);
+  while (cache->count[rank - 1] < pool->pcp_low && (b = area->head[MIGRATE_MOVABLE]) != NULL) {
+    struct zone *z = b->zone;
+    int pfn = pfn_of(z, b);
+    remove_free(pool, z, pfn, rank);
+    pcp_push(cache, z, pfn, rank);
+  }
+  spin_unlock(&area->lock);
+  while (cache->count[rank - 1] < pool->pcp_low) {
+    int missing = pool->pcp_low - cache->count[rank - 1];
+    int want = rank + 31 - __builtin_clz(missing), got;
+    if (want > MAX_RANK) want = MAX_RANK;
+    if ((b = __alloc_block(pool, rank, want, MIGRATE_MOVABLE, &got)) == NULL) break;
+    struct zone *z = b->zone;
+    int pfn = pfn_of(z, b);
+    // The lowest child ends up first in the cache.
+    for (int child = (1 << (got - rank)) - 1; child >= 0; child--) {
+      pcp_push(cache, z, pfn + (child << (rank - 1)), rank);
+    }
+  }
+}
+
+static void pcp_drain_all(struct buddy_pool *pool) {
+  if (pool->pcp == NULL) return;
+  for (int cpu = 0; cpu < PCP_MAX_CPUS; cpu++) {
+    spin_lock(&pool->pcp[cpu].lock);
+    for (int rank = 1; rank <= PCP_MAX_RANK; rank++) {
+      if (pool->pcp[cpu].count[rank - 1] > 0) pcp_drain(pool, &pool->pcp[cpu], rank, 0);
+    }
+    spin_unlock(&pool->pcp[cpu].lock);
+  }
+}
+
+static void *pcp_alloc(struct buddy_pool *pool, int rank) {
+  struct per_cpu_pages *cache = this_cpu_pages(pool);
+  spin_lock(&cache->lock);
+  if (cache->count[rank - 1] == 0) pcp_refill(pool, cache, rank);
+  struct free_block *b = cache->list[rank - 1];
+  if (b != NULL) {
+    cache->list[rank - 1] = b->next;
+    cache->count[rank - 1]--;
+    b->zone->rank_of_page[pfn_of(b->zone, b)] = rank;
+  }
+  spin_unlock(&cache->lock);
+  return b;
+}
+
+static void pcp_free(struct buddy_pool *pool, struct zone *z, void *p, int rank) {
+  struct per_cpu_pages *cache = this_cpu_pages(pool);
+  spin_lock(&cache->lock);
+  pcp_push(cache, z, pfn_of(z, p), rank);
+  if (cache->count[rank - 1] > pool->pcp_high) pcp_drain(pool, cache, rank, pool->pcp_low);
+  spin_unlock(&cache->lock);
+}
+
+// Put back what the per-CPU caches and lazy coalescing hold back, before
+// an allocation gives up. Returns whether that may have helped.
+static int reclaim_free(struct buddy_pool *pool) {
+  int changed = 0;
+  if (pool->pcp_high > 0) {
+    pcp_drain_all(pool);
+    changed = 1;
+  }
+  if (pool->lazy_rank > 0 && __atomic_load_n(&pool->lazy_frees, __ATOMIC_RELAXED) > 0) {
+    coalesce(pool, pool->lazy_rank);
+    changed = 1;
+  }
+  return changed;
+}
+
+// Take the head page of an allocated block away from its owner and
+// return the block's rank, or -1 if `pfn` is not such a page. Atomic, so
+// that a racing double free fails.
+static int claim_page(struct zone *z, int pfn) {
+  int8_t rank = __atomic_load_n(&z->rank_of_page[pfn], __ATOMIC_ACQUIRE);
+  do {
+    if (rank == -1 || (rank & PAGE_FREE)) return -1;
+  } while (!__atomic_compare_exchange_n(&z->rank_of_page[pfn], &rank, -1, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE));
+  return rank & PAGE_RANK;
+}
+
+// Compaction. Movable blocks are moved out of an aligned range of pages
+// with the relocate callback until the whole range is free; at most one
+// compaction runs at a time.
+#define COMPACT_PASSES 3
+
+void buddy_set_relocate(relocate_fn fn, void *arg) {
+  struct buddy_pool *pool = &default_pool;
+  spin_lock(&pool->compact_lock);
+  pool->relocate = fn;
+  pool->relocate_arg = arg;
+  spin_unlock(&pool->compact_lock);
+}
+
+void query_compact_stats(struct compact_stats *stats) {
+  struct buddy_pool *pool = &default_pool;
+  spin_lock(&pool->compact_lock);
+  *stats = pool->compact_stats;
+  spin_unlock(&pool->compact_lock);
+}
+
+// Pages that have to be moved to empty [first, first + size), or -1 if an
+// unmovable block is in the way.
+static int compact_cost(struct zone *z, int first, int size) {
+  int cost = 0;
+  for (int pfn = first; pfn < first + size;) {
+    int v = z->rank_of_page[pfn];
+    if (v == -1) {
+      // changing hands right now
+      cost++;
+      pfn++;
+      continue;
+    }
+    if ((v & PAGE_FREE) == 0) {
+      if (v & PAGE_UNMOVABLE) return -1;
+      cost += 1 << ((v & PAGE_RANK) - 1);
+    }
+    pfn += 1 << ((v & PAGE_RANK) - 1);
+  }
+  return cost;
+}
+
+// Move the allocated block at `pfn` out of [first, first + size), and
+// return its rank, 0 to try again later, or -1 on failure.
+static int move_block(struct buddy_pool *pool, struct zone *z, int pfn, int first, int size) {
+  int rank = claim_page(z, pfn);
+  if (rank == -1) return 0;
+  for (;;) {
+    struct free_block *to = __alloc_pages(pool, rank, MIGRATE_MOVABLE);
+    if (to == NULL) break;
+    struct zone *tz = to->zone;
+    int tpfn = pfn_of(tz, to);
+    if (tz == z && tpfn >= first && tpfn < first + size) {
+      // Freed into the range after it was scanned: keep it.
+      z->rank_of_page[tpfn] = rank | PAGE_HELD;
+      continue;
+    }
+    tz->rank_of_page[tpfn] = rank;
+    if (pool->relocate(block_of(z, pfn), to, rank, pool->relocate_arg) == 0) {
+      z->rank_of_page[pfn] = rank | PAGE_HELD;
+      pool->compact_stats.pages_moved += 1 << (rank - 1);
+      return rank;
+    }
+    tz->rank_of_page[tpfn] = -1;
+    __return_pages(pool, tz, tpfn, rank);
+    break;
+  }
+  __atomic_store_n(&z->rank_of_page[pfn], rank, __ATOMIC_RELEASE);
+  return -1;
+}
+
+// Take every page of [first, first + 2^(rank - 1)) off the free lists and
+// out of the hands of its owners. Returns the block, or NULL after giving
+// back whatever was taken.
+static struct free_block *compact_range(struct buddy_pool *pool, struct zone *z, int first,
+                                        int rank) {
+  int size = 1 << (rank - 1), held = 0;
+  for (int pass = 0; pass < COMPACT_PASSES && held < size; pass++) {
+    for (int pfn = first; pfn < first + size;) {
+      int v = z->rank_of_page[pfn], r = v & PAGE_RANK;
+      if (v == -1 || r >= rank) {
+        pfn++;
+        continue;
+      }
+      if ((v & PAGE_HELD) == PAGE_HELD) {
+        // taken in an earlier pass
+      } else if (v & PAGE_FREE) {
+        spin_lock(&pool->free_area[r - 1].lock);
+        int on_list = test_block(z, pfn, r);
+        if (on_list) remove_free(pool, z, pfn, r);
+        spin_unlock(&pool->free_area[r - 1].lock);
+        if (on_list) {
+          z->rank_of_page[pfn] = r | PAGE_HELD;
+          held += 1 << (r - 1);
+        }
+      } else if (v & PAGE_UNMOVABLE) {
+        goto fail;
+      } else {
+        int moved = move_block(pool, z, pfn, first, size);
+        if (moved < 0) goto fail;
+        if (moved > 0) held += 1 << (moved - 1);
+      }
+      pfn += 1 << (r - 1);
+    }
+    // Blocks found by move_block(pool) were not counted, recount.
+    held = 0;
+    for (int pfn = first; pfn < first + size; pfn++) {
+      int v = z->rank_of_page[pfn];
+      if (v != -1 && (v & PAGE_HELD) == PAGE_HELD) held += 1 << ((v & PAGE_RANK) - 1);
+    }
+  }
+  if (held == size) {
+    for (int pfn = first; pfn < first + size; pfn++) z->rank_of_page[pfn] = -1;
+    return block_of(z, first);
+  }
+fail:
+  for (int pfn = first; pfn < first + size; pfn++) {
+    int v = z->rank_of_page[pfn];
+    if (v != -1 && (v & PAGE_HELD) == PAGE_HELD) {
+      z->rank_of_page[pfn] = -1;
+      __return_pages(pool, z, pfn, v & PAGE_RANK);
+    }
+  }
+  return NULL;
+}
+
+// Make room for a block of `rank` by emptying the range that takes the
+// fewest moves, if the other free pages can hold what is in it.
+static struct free_block *compact(struct buddy_pool *pool, int rank, int type) {
+  struct timespec start, stop;
+  struct free_block *b = NULL;
+  spin_lock(&pool->compact_lock);
+  if (pool->relocate == NULL) {
+    spin_unlock(&pool->compact_lock);
+    return NULL;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pcp_drain_all(pool);
+  int size = 1 << (rank - 1), best = -1, best_first = 0;
+  struct zone *best_zone = NULL;
+  for (int i = 0; i < pool->nr_zones; i++) {
+    struct zone *z = &pool->zones[i];
+    for (int first = 0; first + size <= z->pg_num; first += size) {
+      int cost = compact_cost(z, first, size);
+      if (cost >= 0 && (best < 0 || cost < best)) {
+        best = cost;
+        best_first = first;
+        best_zone = z;
+      }
+    }
+  }
+  if (best_zone != NULL && free_pages(pool) - (size - best) >= best) {
+    b = compact_range(pool, best_zone, best_first, rank);
+  }
+  if (b != NULL) {
+    if (rank >= PAGEBLOCK_RANK) {
+      memset(&best_zone->pageblock_type[pageblock_of(best_first)], type, 1 << (rank - PAGEBLOCK_RANK));
+    }
+    best_zone->rank_of_page[best_first] = alloc_mark(rank, type);
+    pool->compact_stats.compactions++;
+  } else {
+    pool->compact_stats.failures++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  pool->compact_stats.nsec +=
+      (stop.tv_sec - start.tv_sec) * 1000000000L + (stop.tv_nsec - start.tv_nsec);
+  spin_unlock(&pool->compact_lock);
+  return b;
+}
+
+void *buddy_pool_alloc(struct buddy_pool *pool, int rank, int type) {
+  if (rank < 1 || rank > MAX_RANK || type < 0 || type >= MIGRATE_TYPES) return ERR_PTR(-EINVAL);
+  stat_start(start);
+  int cached = rank <= PCP_MAX_RANK && pool->pcp_high > 0 && type == MIGRATE_MOVABLE;
+  void *p = cached ? pcp_alloc(pool, rank) : alloc_from_core(pool, rank, type);
+  if (p == NULL && reclaim_free(pool)) {
+    // The caches and unmerged buddies may hold what the core is missing.
+    p = alloc_from_core(pool, rank, type);
+  }
+  if (p == NULL && rank > 1 && pool->relocate != NULL) p = compact(pool, rank, type);
+  stat_latency(start);
+  if (p == NULL) {
+    stat_inc(failures, rank);
+    trace_event(BUDDY_EV_FAIL, rank, NULL);
+    return ERR_PTR(-ENOSPC);
+  }
+  stat_inc(allocs, rank);
+  trace_event(BUDDY_EV_ALLOC, rank, p);
+  return p;
+}
+
+void *alloc_pages_type(int rank, int type) { return buddy_pool_alloc(&default_pool, rank, type); }
+
+void *alloc_pages(int rank) { return alloc_pages_type(rank, MIGRATE_MOVABLE); }
+
+int buddy_pool_free(struct buddy_pool *pool, void *p) {
+  struct zone *z = zone_of(pool, p);
+  if (z == NULL || (((uint8_t *)p - z->start) & (PAGE_SIZE - 1)) != 0) {
     return -EINVAL;
   }
-  int rank = rank_of_page[page_idx];
+  int pfn = pfn_of(z, p);
+  int rank = claim_page(z, pfn);
   if (rank == -1) {
     return -EINVAL;
   }
-  rank_of_page[page_idx] = -1;
-  int node_idx = (max_page_num + page_idx) >> (rank - 1);
-  // recursively merge with buddy
-  while (rank < max_rank) {
-    node[node_idx].is_allocated = 0;
-    int buddy_idx = node_idx ^ 1;
-    struct tree_node *buddy = &node[buddy_idx];
-    // check if buddy is free
-    if (buddy->is_allocated != 0) break;
-    // remove buddy from free list
-    if (buddy->prev != NULL) {
-      buddy->prev->next = buddy->next;
-    } else {
-      free_list[rank - 1].head = buddy->next;
+  stat_inc(frees, rank);
+  trace_event(BUDDY_EV_FREE, rank, p);
+  if (rank <= PCP_MAX_RANK && pool->pcp_high > 0 &&
+      z->pageblock_type[pageblock_of(pfn)] == MIGRATE_MOVABLE) {
+    pcp_free(pool, z, p, rank);
+  } else if (rank <= pool->lazy_rank) {
+    lazy_return_pages(pool, z, pfn, rank);
+  } else {
+    __return_pages(pool, z, pfn, rank);
+  }
+  return OK;
+}
+
+int return_pages(void *p) { return buddy_pool_free(&default_pool, p); }
+
+// The pieces of an exact allocation of `npages` pages: one block per set
+// bit of npages, largest first, so that each is aligned to its size.
+// Returns the rank of the piece at *pfn, and moves past it.
+static int next_piece(int *pfn, int *npages) {
+  int rank = 32 - __builtin_clz(*npages);
+  *pfn += 1 << (rank - 1);
+  *npages -= 1 << (rank - 1);
+  return rank;
+}
+
+void *alloc_pages_exact(int npages) {
+  struct buddy_pool *pool = &default_pool;
+  if (npages < 1 || npages > 1 << (MAX_RANK - 1)) return ERR_PTR(-EINVAL);
+  int rank = npages == 1 ? 1 : 33 - __builtin_clz(npages - 1);
+  void *p = buddy_pool_alloc(pool, rank, MIGRATE_MOVABLE);
+  if (IS_ERR(p)) return p;
+  struct zone *z = zone_of(pool, p);
+  int pfn = pfn_of(z, p), end = pfn + (1 << (rank - 1));
+  for (int left = npages; left > 0;) {
+    int head = pfn;
+    z->rank_of_page[head] = alloc_mark(next_piece(&pfn, &left), MIGRATE_MOVABLE);
+  }
+  // The tail goes back as the largest aligned blocks that fit.
+  while (pfn < end) {
+    int r = __builtin_ctz(pfn) + 1;
+    while (pfn + (1 << (r - 1)) > end) r--;
+    __return_pages(pool, z, pfn, r);
+    pfn += 1 << (r - 1);
+  }
+  return p;
+}
+
+int return_pages_exact(void *p, int npages) {
+  struct buddy_pool *pool = &default_pool;
+  struct zone *z = zone_of(pool, p);
+  if (z == NULL || (((uint8_t *)p - z->start) & (PAGE_SIZE - 1)) != 0) return -EINVAL;
+  if (npages < 1 || pfn_of(z, p) + npages > z->pg_num) return -EINVAL;
+  // Every piece has to be there before any of them is freed.
+  int pfn = pfn_of(z, p);
+  for (int left = npages; left > 0;) {
+    int head = pfn, rank = next_piece(&pfn, &left);
+    if ((z->rank_of_page[head] & (PAGE_FREE | PAGE_RANK)) != rank) return -EINVAL;
+  }
+  pfn = pfn_of(z, p);
+  int ret = OK;
+  for (int left = npages; left > 0;) {
+    int head = pfn;
+    next_piece(&pfn, &left);
+    if (buddy_pool_free(pool, block_of(z, head)) != OK) ret = -EINVAL;
+  }
+  return ret;
+}
+
+int alloc_pages_bulk(int rank, int n, void **out) {
+  struct buddy_pool *pool = &default_pool;
+  if (rank < 1 || rank > MAX_RANK || n < 0 || (n > 0 && out == NULL)) return -EINVAL;
+  int count = 0, reclaimed = 0;
+  while (count < n) {
+    // Take the block that covers as much of the rest as possible, and
+    // hand out all of its children without putting them on a list.
+    int want = rank + 31 - __builtin_clz(n - count), got;
+    if (want > MAX_RANK) want = MAX_RANK;
+    struct free_block *b = __alloc_block(pool, rank, want, MIGRATE_MOVABLE, &got);
+    if (b == NULL) {
+      if (reclaimed || !reclaim_free(pool)) break;
+      reclaimed = 1;
+      continue;
     }
-    if (buddy->next != NULL) {
-      buddy->next->prev = buddy->prev;
+    struct zone *z = b->zone;
+    int pfn = pfn_of(z, b);
+    for (int i = 0; i < 1 << (got - rank); i++, pfn += 1 << (rank - 1)) {
+      z->rank_of_page[pfn] = rank;
+      trace_event(BUDDY_EV_ALLOC, rank, block_of(z, pfn));
+      out[count++] = block_of(z, pfn);
+    }
+    stat_add(allocs, rank, 1 << (got - rank));
+  }
+  if (count < n) {
+    stat_inc(failures, rank);
+    trace_event(BUDDY_EV_FAIL, rank, NULL);
+  }
+  return count;
+}
+
+static int cmp_page(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t) * (void *const *)a, y = (uintptr_t) * (void *const *)b;
+  return x < y ? -1 : x > y;
+}
+
+int return_pages_bulk(void **pages, int n) {
+  struct buddy_pool *pool = &default_pool;
+  if (n < 0 || (n > 0 && pages == NULL)) return -EINVAL;
+  int ret = OK;
+  qsort(pages, n, sizeof(void *), cmp_page);
+  // Blocks are claimed in address order and stacked; whenever the top two
+  // are buddies they are merged on the spot, so a sorted run of returns
+  // reaches the core as a few large blocks.
+  struct {
+    struct zone *zone;
+    int pfn, rank;
+  } stack[2 * MAX_RANK];
+  int top = 0;
+  for (int i = 0; i <= n; i++) {
+    struct zone *z = NULL;
+    int pfn = 0, rank = 0;
+    if (i < n) {
+      z = zone_of(pool, pages[i]);
+      if (z == NULL || (((uint8_t *)pages[i] - z->start) & (PAGE_SIZE - 1)) != 0) {
+        ret = -EINVAL;
+        continue;
+      }
+      pfn = pfn_of(z, pages[i]);
+      rank = claim_page(z, pfn);
+      if (rank == -1) {
+        ret = -EINVAL;
+        continue;
+      }
+      stat_inc(frees, rank);
+      trace_event(BUDDY_EV_FREE, rank, pages[i]);
+    }
+    // Flush the stack when the next block cannot extend it.
+    if (top > 0 && (i == n || top == 2 * MAX_RANK || stack[top - 1].zone != z ||
+                    stack[top - 1].pfn + (1 << (stack[top - 1].rank - 1)) != pfn)) {
+      while (top > 0) {
+        top--;
+        __return_pages(pool, stack[top].zone, stack[top].pfn, stack[top].rank);
+      }
+    }
+    if (i == n) break;
+    stack[top].zone = z;
+    stack[top].pfn = pfn;
+    stack[top].rank = rank;
+    top++;
+    while (top >= 2 && stack[top - 1].rank == stack[top - 2].rank &&
+           stack[top - 1].rank < MAX_RANK &&
+           (stack[top - 2].pfn ^ (1 << (stack[top - 2].rank - 1))) == stack[top - 1].pfn) {
+      top--;
+      stat_inc(merges, stack[top - 1].rank);
+      trace_event(BUDDY_EV_MERGE, stack[top - 1].rank, block_of(z, stack[top - 1].pfn));
+      stack[top - 1].rank++;
     }
-    free_list[rank - 1].size--;
-    // jump to parent
-    node_idx = node_idx >> 1;
-    rank++;
   }
-  // add to free list
-  struct tree_node **head = &free_list[rank - 1].head;
-  node[node_idx].next = *head;
-  if (*head != NULL) (*head)->prev = &node[node_idx];
-  (*head) = &node[node_idx];
-  free_list[rank - 1].size++;
+  return ret;
+}
+
+int buddy_pcp_setup(int low, int high) {
+  struct buddy_pool *pool = &default_pool;
+  if (high < 0 || (high > 0 && (low < 1 || low >= high))) return -EINVAL;
+  if (high > 0 && pool->pcp == NULL) {
+    struct per_cpu_pages *pcp = aligned_alloc(64, sizeof(struct per_cpu_pages) * PCP_MAX_CPUS);
+    if (pcp == NULL) return -ENOMEM;
+    memset(pcp, 0, sizeof(struct per_cpu_pages) * PCP_MAX_CPUS);
+    pool->pcp = pcp;
+  }
+  pcp_drain_all(pool);
+  pool->pcp_low = low;
+  pool->pcp_high = high;
   return OK;
 }
 
-static inline int lowbit(int x) { return x & (-x); }
+void buddy_pcp_drain(void) { pcp_drain_all(&default_pool); }
 
-int query_ranks(void *p) {
-  int page_idx = ((uint8_t *)p - mem_start) >> 12;
-  if (page_idx < 0 || page_idx >= max_page_num) {
+// The block of one of `ranks` (a mask, bit r - 1 for rank r) whose head
+// page is marked with `mark | rank`, and which contains `pfn`. Returns its
+// rank and stores its head in *head, or returns 0.
+static int find_block(struct zone *z, int pfn, uint32_t ranks, int mark, int *head) {
+  for (; ranks != 0; ranks &= ranks - 1) {
+    int rank = __builtin_ctz(ranks) + 1;
+    int h = pfn & ~((1 << (rank - 1)) - 1);
+    if ((z->rank_of_page[h] & (PAGE_FREE | PAGE_RANK)) == (mark | rank)) {
+      *head = h;
+      return rank;
+    }
+  }
+  return 0;
+}
+
+int buddy_pool_query_ranks(struct buddy_pool *pool, void *p) {
+  struct zone *z = zone_of(pool, p);
+  if (z == NULL) {
     return -EINVAL;
   }
-  int rank = rank_of_page[page_idx];
-  if (rank == -1) {
-    // unallocated page, find the largest rank
-    rank = 1;
-    int low_bit = lowbit((1 << (max_rank - 1)) | page_idx);
-    // printf("page_idx %d, lowbit %d\n", page_idx, low_bit);
-    for (int i = page_idx + 1; i < page_idx + low_bit; i += lowbit(i)) {
-      // printf("i %d, rank_of_page[i] %d\n", i, rank_of_page[i]);
-      if (rank_of_page[i] != -1) break;
-      rank++;
+  int page_idx = pfn_of(z, p);
+  int rank = z->rank_of_page[page_idx];
+  if (rank != -1) {
+    // head page of an allocated or free block
+    return rank & PAGE_RANK;
+  }
+  // A page inside a free block: only ranks that have free blocks can hold
+  // it. Its answer is the largest free block starting at the page.
+  uint32_t ranks = 0;
+  for (int type = 0; type < MIGRATE_TYPES; type++) {
+    ranks |= __atomic_load_n(&pool->free_area_mask[type], __ATOMIC_RELAXED);
+  }
+  if (pool->pcp_high > 0) ranks |= (1u << PCP_MAX_RANK) - 1;
+  int head;
+  if (find_block(z, page_idx, ranks, PAGE_FREE, &head) != 0) {
+    return __builtin_ctz(page_idx - head) + 1;
+  }
+  // A page inside an allocated block: the rank of that block.
+  rank = find_block(z, page_idx, (1u << MAX_RANK) - 1, 0, &head);
+  return rank != 0 ? rank : -EINVAL;
+}
+
+int query_ranks(void *p) { return buddy_pool_query_ranks(&default_pool, p); }
+
+void *query_block_head(void *p) {
+  struct buddy_pool *pool = &default_pool;
+  struct zone *z = zone_of(pool, p);
+  if (z == NULL) {
+    return ERR_PTR(-EINVAL);
+  }
+  int head;
+  if (find_block(z, pfn_of(z, p), (1u << MAX_RANK) - 1, 0, &head) == 0) {
+    return ERR_PTR(-EINVAL);
+  }
+  return block_of(z, head);
+}
+
+int buddy_pool_page_counts(struct buddy_pool *pool, int rank) {
+  if (rank < 1 || rank > MAX_RANK) return -EINVAL;
+  return pool->free_area[rank - 1].size;
+}
+
+int query_page_counts(int rank) { return buddy_pool_page_counts(&default_pool, rank); }
+
+int query_fragmentation_index(int rank) {
+  struct buddy_pool *pool = &default_pool;
+  if (rank < 1 || rank > MAX_RANK) return -EINVAL;
+  long blocks = 0, pages = 0, suitable = 0;
+  for (int r = 1; r <= MAX_RANK; r++) {
+    long n = __atomic_load_n(&pool->free_area[r - 1].size, __ATOMIC_RELAXED);
+    blocks += n;
+    pages += n << (r - 1);
+    if (r >= rank) suitable += n;
+  }
+  if (blocks == 0) return 0;
+  if (suitable > 0) return -1000;
+  // The same formula as Linux's fragmentation_index().
+  return 1000 - (1000 + pages * 1000 / (1L << (rank - 1))) / blocks;
+}
+
+int query_largest_free(void) {
+  struct buddy_pool *pool = &default_pool;
+  uint32_t ranks = 0;
+  for (int type = 0; type < MIGRATE_TYPES; type++) {
+    ranks |= __atomic_load_n(&pool->free_area_mask[type], __ATOMIC_RELAXED);
+  }
+  return ranks != 0 ? 32 - __builtin_clz(ranks) : 0;
+}
+
+int query_free_histogram(int *out) {
+  struct buddy_pool *pool = &default_pool;
+  if (out == NULL) return -EINVAL;
+  for (int rank = 1; rank <= MAX_RANK; rank++) {
+    out[rank - 1] = __atomic_load_n(&pool->free_area[rank - 1].size, __ATOMIC_RELAXED);
+  }
+  return OK;
+}
+
+int buddy_scavenge_setup(int rank, long keep, int advice) {
+  struct buddy_pool *pool = &default_pool;
+  if (rank < 0 || rank == 1 || rank > MAX_RANK || keep < 0) return -EINVAL;
+  if (advice != MADV_FREE && advice != MADV_DONTNEED) return -EINVAL;
+  spin_lock(&pool->scavenge_lock);
+  pool->scavenge_rank = rank;
+  pool->scavenge_keep = keep;
+  pool->scavenge_advice = advice;
+  spin_unlock(&pool->scavenge_lock);
+  return OK;
+}
+
+long buddy_scavenge(void) {
+  struct buddy_pool *pool = &default_pool;
+  long count = 0;
+  spin_lock(&pool->scavenge_lock);
+  int rank = pool->scavenge_rank;
+  if (rank > 0) count = scavenge(pool, rank);
+  spin_unlock(&pool->scavenge_lock);
+  return count;
+}
+
+int buddy_lazy_setup(int rank, int threshold) {
+  struct buddy_pool *pool = &default_pool;
+  if (rank < 0 || rank > MAX_RANK || threshold < 0) return -EINVAL;
+  // Blocks freed lazily so far still need their pass.
+  int old = pool->lazy_rank;
+  pool->lazy_rank = 0;
+  if (old > 0) coalesce(pool, old);
+  pool->lazy_threshold = threshold;
+  pool->lazy_rank = rank;
+  return OK;
+}
+
+void buddy_coalesce(void) {
+  struct buddy_pool *pool = &default_pool;
+  if (pool->lazy_rank > 0) coalesce(pool, pool->lazy_rank);
+}
+
+long query_released_pages(void) {
+  return __atomic_load_n(&default_pool.released_pages, __ATOMIC_RELAXED);
+}
+
+int query_buddy_stats(struct buddy_stats *stats) {
+#ifdef BUDDY_STATS
+  if (stats == NULL) return -EINVAL;
+  long *from = (long *)&buddy_stats, *to = (long *)stats;
+  for (size_t i = 0; i < sizeof(buddy_stats) / sizeof(long); i++) {
+    to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+  return OK;
+#else
+  (void)stats;
+  return -ENOSYS;
+#endif
+}
+
+void buddy_stats_reset(void) {
+#ifdef BUDDY_STATS
+  long *counters = (long *)&buddy_stats;
+  for (size_t i = 0; i < sizeof(buddy_stats) / sizeof(long); i++) {
+    __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+  }
+#endif
+}
+
+int buddy_trace_read(struct buddy_event *out, int n) {
+#ifdef BUDDY_TRACE
+  if (n < 0 || (n > 0 && out == NULL)) return -EINVAL;
+  unsigned long head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+  unsigned long first = head > (unsigned long)n ? head - n : 0;
+  if (head - first > BUDDY_TRACE_SIZE) first = head - BUDDY_TRACE_SIZE;
+  int count = 0;
+  for (unsigned long seq = first + 1; seq <= head; seq++) {
+    // Skip events that are still being written or already overwritten.
+    struct buddy_event *e = &trace_ring[(seq - 1) % BUDDY_TRACE_SIZE];
+    if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq) continue;
+    out[count] = *e;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) continue;
+    out[count++].seq = seq;
+  }
+  return count;
+#else
+  (void)out;
+  (void)n;
+  return -ENOSYS;
+#endif
+}
+
+// Append to buf as snprintf() would, and advance *off past what would
+// have been written.
+static void info_printf(char *buf, int len, int *off, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int room = *off < len ? len - *off : 0;
+  *off += vsnprintf(room > 0 ? buf + *off : NULL, room, fmt, ap);
+  va_end(ap);
+}
+
+int buddy_info(char *buf, int len) {
+  struct buddy_pool *pool = &default_pool;
+  static const char *type_names[MIGRATE_TYPES] = {
+      [MIGRATE_UNMOVABLE] = "unmovable",
+      [MIGRATE_MOVABLE] = "movable",
+      [MIGRATE_RECLAIMABLE] = "reclaimable",
+  };
+  if (len < 0 || (len > 0 && buf == NULL)) return -EINVAL;
+  int off = 0;
+  if (len > 0) buf[0] = '\0';
+  info_printf(buf, len, &off, "%-12s", "rank");
+  for (int rank = 1; rank <= MAX_RANK; rank++) info_printf(buf, len, &off, " %6d", rank);
+  info_printf(buf, len, &off, "\n");
+  // A zone's free blocks are the set bits of its bitmaps.
+  for (int i = 0; i < pool->nr_zones; i++) {
+    struct zone *z = &pool->zones[i];
+    info_printf(buf, len, &off, "zone %-7d", i);
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+      long n = 0;
+      size_t words = (((size_t)z->pg_num >> (rank - 1)) + 64) / 64;
+      spin_lock(&pool->free_area[rank - 1].lock);
+      for (size_t w = 0; w < words; w++) n += __builtin_popcountll(z->free_bitmap[rank - 1][w]);
+      spin_unlock(&pool->free_area[rank - 1].lock);
+      info_printf(buf, len, &off, " %6ld", n);
     }
+    info_printf(buf, len, &off, "\n");
   }
-  // printf("query_ranks: p %p, rank %d\n", p, rank);
-  return rank;
+  for (int type = 0; type < MIGRATE_TYPES; type++) {
+    info_printf(buf, len, &off, "%-12s", type_names[type]);
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+      long n = 0;
+      spin_lock(&pool->free_area[rank - 1].lock);
+      for (struct free_block *b = pool->free_area[rank - 1].head[type]; b != NULL; b = b->next) n++;
+      spin_unlock(&pool->free_area[rank - 1].lock);
+      info_printf(buf, len, &off, " %6ld", n);
+    }
+    info_printf(buf, len, &off, "\n");
+  }
+  return off;
+}
+
+// Size of a pool mapping: whole huge pages, so that munmap() of a
+// hugetlbfs mapping gets a valid length.
+static size_t pool_bytes(int pgcount, int huge) {
+  size_t align = huge == POOL_HUGE_1G ? 1UL << 30 : 1UL << 21;
+  return (((size_t)pgcount << PAGE_SHIFT) + align - 1) & ~(align - 1);
+}
+
+void *map_pool(int pgcount, int huge) {
+  if (pgcount <= 0 || huge < POOL_SMALL || huge > POOL_HUGE_1G) return ERR_PTR(-EINVAL);
+  size_t len = pool_bytes(pgcount, huge);
+  size_t align = huge == POOL_HUGE_1G ? 1UL << 30 : 1UL << 21;
+  if (huge != POOL_SMALL) {
+    // Reserved huge pages first; they only exist if the admin set some up.
+    int size_flag = huge == POOL_HUGE_1G ? 30 << MAP_HUGE_SHIFT : 21 << MAP_HUGE_SHIFT;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | size_flag, -1, 0);
+    if (p != MAP_FAILED) return p;
+  }
+  // Otherwise over-map and trim to the alignment, and let THP back it.
+  uint8_t *raw = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (raw == MAP_FAILED) return ERR_PTR(-ENOMEM);
+  uint8_t *p = (uint8_t *)(((uintptr_t)raw + align - 1) & ~(align - 1));
+  if (p > raw) munmap(raw, p - raw);
+  munmap(p + len, raw + align - p);
+  madvise(p, len, huge == POOL_SMALL ? MADV_NOHUGEPAGE : MADV_HUGEPAGE);
+  return p;
 }
 
-int query_page_counts(int rank) {
-  // printf("query_page_counts: rank %d, size %d\n", rank, free_list[rank - 1].size);
-  return free_list[rank - 1].size;
+int unmap_pool(void *p, int pgcount, int huge) {
+  if (p == NULL || pgcount <= 0 || huge < POOL_SMALL || huge > POOL_HUGE_1G) return -EINVAL;
+  return munmap(p, pool_bytes(pgcount, huge)) == 0 ? OK : -EINVAL;
 }
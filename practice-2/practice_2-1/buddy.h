@@ -1,12 +1,16 @@
 #ifndef OS_MM_H
 #define OS_MM_H
+#include <stddef.h>
 #define MAX_ERRNO 4095
-#define MAX_RANK    16
+#define MAX_RANK    19  /* 4K << 18 = 1 GiB blocks */
+#define MAX_ZONES   8
 #define PAGE_SIZE 4096
 
 #define OK          0
+#define ENOMEM      12  /* Out of memory for metadata */
 #define EINVAL      22  /* Invalid argument */    
 #define ENOSPC      28  /* No page left */  
+#define ENOSYS      38  /* Not compiled in */
 
 
 #define IS_ERR_VALUE(x) ((x) >= (unsigned long)-MAX_ERRNO)
@@ -16,9 +20,169 @@ static inline long IS_ERR(const void *ptr) { return IS_ERR_VALUE((unsigned long)
 
 
 int init_page(void *p, int pgcount);
+// Register another disjoint run of `pgcount` pages. init_page() drops
+// every zone registered so far.
+int add_zone(void *p, int pgcount);
 void *alloc_pages(int rank);
 int return_pages(void *p);
 int query_ranks(void *p);
+// Allocate up to `n` blocks of `rank` into out[] and return how many were
+// allocated. Large free blocks are split once and all of their children
+// handed out. Bypasses the per-CPU caches.
+int alloc_pages_bulk(int rank, int n, void **out);
+// Return `n` blocks at once. The array is sorted in place, and runs of
+// buddies in it are merged before they reach the free lists. Invalid
+// entries are skipped and make the call return -EINVAL.
+int return_pages_bulk(void **pages, int n);
+// Allocate exactly `npages` contiguous pages: the enclosing block is
+// allocated and the pages past npages go straight back to the free lists.
+// What is kept is one allocated block per set bit of npages, largest
+// first, and query_ranks() answers their ranks. Free it with
+// return_pages_exact() and the same npages.
+void *alloc_pages_exact(int npages);
+int return_pages_exact(void *p, int npages);
 int query_page_counts(int rank);
+// The first page of the allocated block containing `p`.
+void *query_block_head(void *p);
+
+// Migrate types. Free blocks are grouped by the type of their pageblock,
+// an aligned run of 2^(PAGEBLOCK_RANK - 1) pages, so that long-lived
+// unmovable pages do not scatter over the whole pool. A type that runs
+// out steals from the others, and takes over whole pageblocks when it
+// does. alloc_pages() and the bulk calls allocate MIGRATE_MOVABLE.
+#define MIGRATE_UNMOVABLE   0
+#define MIGRATE_MOVABLE     1
+#define MIGRATE_RECLAIMABLE 2
+#define MIGRATE_TYPES       3
+#define PAGEBLOCK_RANK      10  /* 2 MiB */
+void *alloc_pages_type(int rank, int type);
+// How much a failure to allocate `rank` would be due to fragmentation,
+// in thousandths: near 0 means there is too little free memory, near
+// 1000 that there is enough but in blocks that are too small. -1000 if
+// a block of `rank` is free.
+int query_fragmentation_index(int rank);
+// Rank of the largest free block, 0 if there is none. Constant time.
+int query_largest_free(void);
+// Free blocks of each rank into out[0 .. MAX_RANK - 1], like
+// query_page_counts() for every rank at once.
+int query_free_histogram(int *out);
+
+// Compaction. Once a relocate callback is set, an allocation of rank > 1
+// that finds no free block moves allocated movable blocks out of the
+// cheapest aligned range of the size it needs, and takes that range. The
+// callback must copy the `rank` block at `from` to `to`, repoint every
+// reference to it and return 0, or return non-zero to refuse. While it
+// runs, return_pages(from) fails, so the owner of the pages should not
+// free them concurrently with relocation.
+typedef int (*relocate_fn)(void *from, void *to, int rank, void *arg);
+void buddy_set_relocate(relocate_fn fn, void *arg);
+
+struct compact_stats {
+  long compactions;  // allocations that compaction made possible
+  long failures;
+  long pages_moved;
+  long nsec;         // time spent compacting
+};
+void query_compact_stats(struct compact_stats *stats);
+
+// Memory for a pool of `pgcount` pages, to hand to init_page() or
+// add_zone(). The mapping starts on a huge page boundary, so the pool's
+// blocks of rank >= 10 (2 MiB) are huge page aligned, and it is backed by
+// reserved huge pages (MAP_HUGETLB) if there are any, else by transparent
+// huge pages (MADV_HUGEPAGE). POOL_SMALL asks for 4 KiB pages only.
+#define POOL_SMALL   0
+#define POOL_HUGE_2M 1
+#define POOL_HUGE_1G 2
+void *map_pool(int pgcount, int huge);
+int unmap_pool(void *p, int pgcount, int huge);
+
+// Give free memory back to the OS. Free blocks of rank >= `rank` are
+// released with `advice` (MADV_FREE or MADV_DONTNEED), all but their
+// first page which holds the free list links, whenever a free of such a
+// block leaves more than `keep` free pages resident. Released pages fault
+// back in when they are allocated and touched. rank = 0 disables.
+int buddy_scavenge_setup(int rank, long keep, int advice);
+// Release now whatever the threshold would; returns the pages released.
+long buddy_scavenge(void);
+// Pages of free blocks that are released and not touched since. Pages
+// of pools that were never touched are not counted.
+long query_released_pages(void);
+
+// Per-CPU caches for blocks of rank <= PCP_MAX_RANK, disabled by default.
+// An empty cache is refilled with `low` blocks at once, and a cache that
+// grows beyond `high` blocks is drained back to `low`; high = 0 disables
+// the caches. Cached blocks do not show up in query_page_counts() until
+// they are drained. The caches are allocated when they are first enabled;
+// returns -ENOMEM if that fails.
+#define PCP_MAX_RANK 2
+int buddy_pcp_setup(int low, int high);
+void buddy_pcp_drain(void);
+
+// Lazy coalescing, disabled by default. Blocks of rank <= `rank` are
+// freed without merging them with their buddies; a pass merges them all
+// after every `threshold` such frees (0: never), and whenever an
+// allocation would fail otherwise. Unmerged buddies show up as two
+// blocks in query_page_counts(). rank = 0 disables and merges.
+int buddy_lazy_setup(int rank, int threshold);
+void buddy_coalesce(void);
+
+// Statistics, compiled in with -DBUDDY_STATS. Without it the counters
+// cost nothing and query_buddy_stats() returns -ENOSYS.
+#define BUDDY_LATENCY_BUCKETS 32
+struct buddy_stats {
+  long allocs[MAX_RANK];    // blocks handed out, by rank
+  long frees[MAX_RANK];     // blocks given back, by rank
+  long failures[MAX_RANK];  // allocations that found no block
+  long splits[MAX_RANK];    // blocks of rank r split into two of r - 1
+  long merges[MAX_RANK];    // pairs of rank r merged into one of r + 1
+  // alloc_pages_type() calls that took [2^i, 2^(i+1)) nanoseconds.
+  long latency[BUDDY_LATENCY_BUCKETS];
+};
+int query_buddy_stats(struct buddy_stats *stats);
+void buddy_stats_reset(void);
+
+// Event tracing, compiled in with -DBUDDY_TRACE: the last
+// BUDDY_TRACE_SIZE allocations, frees, splits, merges and failures are
+// kept in a ring buffer. buddy_trace_read() copies up to `n` of the most
+// recent ones to out[], oldest first, and returns how many; -ENOSYS if
+// tracing is not compiled in.
+#define BUDDY_EV_ALLOC 0
+#define BUDDY_EV_FREE  1
+#define BUDDY_EV_SPLIT 2
+#define BUDDY_EV_MERGE 3
+#define BUDDY_EV_FAIL  4
+#define BUDDY_TRACE_SIZE 4096
+struct buddy_event {
+  unsigned long seq;  // 1 for the first event ever recorded
+  long nsec;          // CLOCK_MONOTONIC
+  void *addr;         // the block, NULL for a failure
+  int type;           // BUDDY_EV_*
+  int rank;
+};
+int buddy_trace_read(struct buddy_event *out, int n);
+
+// Write a /proc/buddyinfo style table of the free blocks per rank, one
+// row per zone and one per migrate type, to buf as snprintf() would, and
+// return the length of the whole table. Always available.
+int buddy_info(char *buf, int len);
+
+// Independent pools. All the calls above act on one default pool, set
+// up by init_page(). buddy_pool_create() makes another pool of the
+// `pgcount` pages at `p`, with all of its state in `meta`, which must
+// hold buddy_pool_meta_size(pgcount) bytes. If meta is NULL, the state
+// goes into the last pages of the pool, which are then not handed out.
+// Such a pool has one zone, and no per-CPU caches, lazy coalescing,
+// scavenging or compaction; statistics and the trace are shared by all
+// pools.
+struct buddy_pool;
+size_t buddy_pool_meta_size(int pgcount);
+struct buddy_pool *buddy_pool_create(void *p, int pgcount, void *meta);
+// Frees nothing but what the pool allocated itself; `meta` stays the
+// caller's.
+void buddy_pool_destroy(struct buddy_pool *pool);
+void *buddy_pool_alloc(struct buddy_pool *pool, int rank, int type);
+int buddy_pool_free(struct buddy_pool *pool, void *p);
+int buddy_pool_query_ranks(struct buddy_pool *pool, void *p);
+int buddy_pool_page_counts(struct buddy_pool *pool, int rank);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "buddy.h"
+
+// Allocate and return every page of the pool, one alloc_pages() call per
+// page versus alloc_pages_bulk() and return_pages_bulk().
+
+#define MAXRANK (16)
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+#define DEFAULT_ROUNDS 50
+
+void *pages[PGCOUNT];
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void check_pool(const char *what) {
+    if (query_page_counts(MAXRANK) != 1) {
+        printf("[x] %s: pool not fully merged\n", what);
+        exit(-1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+    void *p = malloc(TESTSIZE * 1024 * 1024);
+    init_page(p, PGCOUNT);
+
+    printf("%-8s %14s %14s\n", "rank", "loop (ns/blk)", "bulk (ns/blk)");
+    for (int rank = 1; rank <= 4; ++rank) {
+        int n = PGCOUNT >> (rank - 1);
+        double loop = 0, bulk = 0, start;
+        for (int r = 0; r < rounds; ++r) {
+            start = now();
+            for (int i = 0; i < n; ++i) {
+                pages[i] = alloc_pages(rank);
+            }
+            for (int i = 0; i < n; ++i) {
+                return_pages(pages[i]);
+            }
+            loop += now() - start;
+            check_pool("loop");
+
+            start = now();
+            if (alloc_pages_bulk(rank, n, pages) != n) {
+                printf("[x] alloc_pages_bulk came up short\n");
+                return -1;
+            }
+            if (return_pages_bulk(pages, n) != OK) {
+                printf("[x] return_pages_bulk failed\n");
+                return -1;
+            }
+            bulk += now() - start;
+            check_pool("bulk");
+        }
+        printf("%-8d %14.1f %14.1f\n", rank, loop * 1e9 / rounds / n, bulk * 1e9 / rounds / n);
+    }
+    free(p);
+    return 0;
+}
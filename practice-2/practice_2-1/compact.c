@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "utils.h"
+int fake_mode = 0;
+int cont = 0;
+
+// Compaction: allocations that fail because the free pages are scattered
+// succeed once a relocate callback lets the allocator move pages.
+
+#define PGCOUNT (1024)
+int tCnt = 0;
+
+// Every page is reached through a handle; relocation repoints it.
+void *handle[PGCOUNT];
+int refuse;
+
+int relocate_page(void *from, void *to, int rank, void *arg) {
+    if (refuse) return -1;
+    memcpy(to, from, (size_t)PAGE_SIZE << (rank - 1));
+    uint64_t id = *(uint64_t *)from;
+    handle[id] = to;
+    (*(int *)arg)++;
+    return 0;
+}
+
+int main() {
+    void *p, *r;
+    int pgIdx, calls = 0;
+    struct compact_stats stats;
+
+    printf("Compaction test suite: \n");
+    p = malloc((size_t)PGCOUNT * PAGE_SIZE);
+    {
+        printf("Phase 1: scattered free pages\n");
+        ok(init_page(p, PGCOUNT) == OK);
+        for (pgIdx = 0; pgIdx < PGCOUNT; pgIdx++) {
+            handle[pgIdx] = alloc_pages(1);
+            *(uint64_t *)handle[pgIdx] = pgIdx;
+        }
+        for (pgIdx = 0; pgIdx < PGCOUNT; pgIdx += 2) {
+            return_pages(handle[pgIdx]);
+            handle[pgIdx] = NULL;
+        }
+        ok(query_page_counts(1) == PGCOUNT / 2);
+        ok(PTR_ERR(alloc_pages(2)) == -ENOSPC);
+    }
+    {
+        printf("Phase 2: compaction moves pages out of the way\n");
+        tCnt = 0;
+        buddy_set_relocate(relocate_page, &calls);
+        r = alloc_pages(2);
+        ok(!IS_ERR(r) && query_ranks(r) == 2);
+        ok(calls == 1);
+        query_compact_stats(&stats);
+        ok(stats.compactions == 1 && stats.pages_moved == 1 && stats.failures == 0);
+        ok(return_pages(r) == OK);
+        // Half of the pool is in use, so a block of half the pool fits.
+        r = alloc_pages(10);
+        ok(!IS_ERR(r));
+        ok(query_ranks(r) == 10);
+        query_compact_stats(&stats);
+        ok(stats.compactions == 2 && stats.pages_moved <= 1 + 256);
+        ok(stats.nsec > 0);
+        tCnt = 0;
+        for (pgIdx = 1; pgIdx < PGCOUNT; pgIdx += 2) {
+            dotOk(*(uint64_t *)handle[pgIdx] == (uint64_t)pgIdx);
+            dotOk(handle[pgIdx] < r || handle[pgIdx] >= r + 512 * PAGE_SIZE);
+        }
+        dotDone();
+        // Nothing is free any more.
+        ok(PTR_ERR(alloc_pages(2)) == -ENOSPC);
+        query_compact_stats(&stats);
+        ok(stats.failures == 1);
+        ok(return_pages(r) == OK);
+    }
+    {
+        printf("Phase 3: what cannot be moved stays\n");
+        tCnt = 0;
+        // One unmovable page in each half of the pool.
+        for (pgIdx = 1; pgIdx < PGCOUNT; pgIdx += 2) {
+            return_pages(handle[pgIdx]);
+        }
+        ok(query_page_counts(11) == 1);
+        void *u1 = alloc_pages_type(1, MIGRATE_UNMOVABLE);
+        void *u2 = alloc_pages_type(1, MIGRATE_UNMOVABLE);
+        ok(u1 == p && u2 == p + PAGE_SIZE);
+        r = alloc_pages(10);
+        ok(r == p + 512 * PAGE_SIZE);
+        ok(PTR_ERR(alloc_pages(10)) == -ENOSPC);
+        ok(return_pages(r) == OK);
+        // Fill the movable half with every other page in use; emptying
+        // it takes 256 moves into the unmovable half.
+        for (pgIdx = 0; pgIdx < 256; pgIdx++) {
+            handle[pgIdx] = alloc_pages(1);
+            *(uint64_t *)handle[pgIdx] = pgIdx;
+            handle[256 + pgIdx] = alloc_pages(1);
+        }
+        for (pgIdx = 256; pgIdx < 512; pgIdx++) {
+            return_pages(handle[pgIdx]);
+        }
+        // A refused relocation leaves everything where it was.
+        refuse = 1;
+        ok(PTR_ERR(alloc_pages(10)) == -ENOSPC);
+        refuse = 0;
+        for (pgIdx = 0; pgIdx < 256; pgIdx++) {
+            dotOk(*(uint64_t *)handle[pgIdx] == (uint64_t)pgIdx);
+        }
+        dotDone();
+        r = alloc_pages(10);
+        ok(r == p + 512 * PAGE_SIZE);
+        tCnt = 0;
+        for (pgIdx = 0; pgIdx < 256; pgIdx++) {
+            dotOk(*(uint64_t *)handle[pgIdx] == (uint64_t)pgIdx && handle[pgIdx] < r);
+        }
+        dotDone();
+        buddy_set_relocate(NULL, NULL);
+    }
+    free(p);
+    finish();
+
+    return 0;
+}
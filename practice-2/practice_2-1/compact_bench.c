@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buddy.h"
+
+// Fill the pool with single pages and free three out of four at random,
+// then allocate rank-10 (2 MiB) blocks until that fails, without and with
+// compaction. Reports the blocks obtained, the pages moved, and the mean
+// and worst latency of a rank-10 allocation.
+
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+#define BIGRANK 10
+
+// Each live page stores its index in live[] in its first word.
+void *live[PGCOUNT], *big[PGCOUNT];
+
+int relocate_live(void *from, void *to, int rank, void *arg) {
+    (void)arg;
+    memcpy(to, from, (size_t)PAGE_SIZE << (rank - 1));
+    live[*(uint64_t *)to] = to;
+    return 0;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run(const char *name, int compaction) {
+    unsigned seed = 1;
+    int nlive = 0, nbig = 0;
+    struct compact_stats before, after;
+    void *q;
+    while (!IS_ERR(q = alloc_pages(1))) live[nlive++] = q;
+    for (int i = 0; i < nlive;) {
+        if (rand_r(&seed) % 4 != 0) {
+            return_pages(live[i]);
+            live[i] = live[--nlive];
+        } else {
+            *(uint64_t *)live[i] = i;
+            i++;
+        }
+    }
+    if (compaction) buddy_set_relocate(relocate_live, NULL);
+    query_compact_stats(&before);
+    double worst = 0, total = 0, start = now();
+    while (!IS_ERR(q = alloc_pages(BIGRANK))) {
+        double t = now() - start;
+        if (t > worst) worst = t;
+        total += t;
+        big[nbig++] = q;
+        start = now();
+    }
+    query_compact_stats(&after);
+    buddy_set_relocate(NULL, NULL);
+    printf("%-12s %6d %8d %10ld %12.1f %12.1f\n", name, nlive, nbig,
+           after.pages_moved - before.pages_moved, nbig ? total * 1e6 / nbig : 0, worst * 1e6);
+    for (int i = 0; i < nlive; i++) {
+        if (*(uint64_t *)live[i] != (uint64_t)i) printf("[x] page %d lost its contents\n", i);
+    }
+    while (nbig > 0) return_pages(big[--nbig]);
+    while (nlive > 0) return_pages(live[--nlive]);
+}
+
+int main(void) {
+    void *p = malloc(TESTSIZE * 1024 * 1024);
+
+    printf("%-12s %6s %8s %10s %12s %12s\n", "compaction", "live", "rank-10", "moved", "mean (us)",
+           "worst (us)");
+    init_page(p, PGCOUNT);
+    run("off", 0);
+    init_page(p, PGCOUNT);
+    run("on", 1);
+    free(p);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "utils.h"
+int fake_mode = 0;
+int cont = 0;
+
+// alloc_pages_exact(): block sizes that are not a power of two.
+
+#define MAXRANK (16)
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+int tCnt = 0;
+
+void *exact[PGCOUNT / 8], *tail[PGCOUNT / 4];
+
+int main() {
+    void *p, *q, *r;
+    int pgIdx;
+
+    printf("Exact allocation test suite: \n");
+    p = malloc(TESTSIZE * 1024 * 1024);
+    {
+        printf("Phase 1: the tail goes back\n");
+        ok(init_page(p, PGCOUNT) == OK);
+        q = alloc_pages_exact(5);
+        ok(q == p);
+        ok(query_ranks(q) == 3);
+        ok(query_ranks(q + 4 * PAGE_SIZE) == 1);
+        ok(query_ranks(q + 5 * PAGE_SIZE) == 1);
+        ok(query_ranks(q + 6 * PAGE_SIZE) == 2);
+        ok(query_page_counts(1) == 1 && query_page_counts(2) == 1);
+        ok(query_page_counts(3) == 0 && query_page_counts(4) == 1);
+        r = alloc_pages(2);
+        ok(r == q + 6 * PAGE_SIZE);
+        ok(return_pages(r) == OK);
+        ok(return_pages_exact(q, 5) == OK);
+        ok(query_page_counts(MAXRANK) == 1 && query_page_counts(1) == 0);
+        q = alloc_pages_exact(4);
+        ok(query_ranks(q) == 3 && query_page_counts(3) == 1);
+        ok(return_pages_exact(q, 4) == OK);
+        q = alloc_pages_exact(PGCOUNT - 1);
+        ok(query_ranks(q + (size_t)(PGCOUNT - 2) * PAGE_SIZE) == 1);
+        ok(query_page_counts(1) == 1);
+        ok(return_pages_exact(q, PGCOUNT - 1) == OK);
+        ok(query_page_counts(MAXRANK) == 1);
+    }
+    {
+        printf("Phase 2: bad arguments\n");
+        tCnt = 0;
+        ok(PTR_ERR(alloc_pages_exact(0)) == -EINVAL);
+        ok(PTR_ERR(alloc_pages_exact((1 << (MAX_RANK - 1)) + 1)) == -EINVAL);
+        ok(PTR_ERR(alloc_pages_exact(PGCOUNT + 1)) == -ENOSPC);
+        q = alloc_pages_exact(7);
+        // A wrong size frees nothing.
+        ok(return_pages_exact(q, 3) == -EINVAL);
+        ok(return_pages_exact(q, 5) == -EINVAL);
+        ok(return_pages_exact(q + PAGE_SIZE, 6) == -EINVAL);
+        ok(query_ranks(q) == 3);
+        ok(return_pages_exact(q, 7) == OK);
+        ok(return_pages_exact(q, 7) == -EINVAL);
+        ok(query_page_counts(MAXRANK) == 1);
+    }
+    {
+        printf("Phase 3: the tails are usable\n");
+        tCnt = 0;
+        for (pgIdx = 0; pgIdx < PGCOUNT / 8; pgIdx++) {
+            exact[pgIdx] = alloc_pages_exact(5);
+            dotOk(!IS_ERR(exact[pgIdx]));
+        }
+        dotDone();
+        ok(PTR_ERR(alloc_pages_exact(5)) == -ENOSPC);
+        ok(query_page_counts(1) == PGCOUNT / 8 && query_page_counts(2) == PGCOUNT / 8);
+        for (pgIdx = 0; pgIdx < PGCOUNT / 4; pgIdx++) {
+            tail[pgIdx] = alloc_pages(1 + pgIdx % 2);
+            dotOk(!IS_ERR(tail[pgIdx]));
+        }
+        dotDone();
+        ok(PTR_ERR(alloc_pages(1)) == -ENOSPC);
+        for (pgIdx = 0; pgIdx < PGCOUNT / 8; pgIdx++) {
+            dotOk(return_pages_exact(exact[pgIdx], 5) == OK);
+        }
+        dotDone();
+        for (pgIdx = 0; pgIdx < PGCOUNT / 4; pgIdx++) return_pages(tail[pgIdx]);
+        ok(query_page_counts(MAXRANK) == 1);
+    }
+    free(p);
+    finish();
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buddy.h"
+
+// Long churn of short-lived movable blocks with a trickle of long-lived
+// unmovable pages, then a count of how many rank-10 (2 MiB) blocks can
+// still be allocated once the movable blocks are gone. The run is done
+// with the long-lived pages allocated as MIGRATE_UNMOVABLE, and again
+// with everything MIGRATE_MOVABLE, i.e. without grouping.
+
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+#define LIVE_MAX 8192
+#define PINNED_MAX 2048
+#define DEFAULT_OPS 2000000
+#define BIGRANK 10
+
+void *live[LIVE_MAX], *pinned[PINNED_MAX], *big[PGCOUNT];
+
+void run(const char *name, int pinned_type, int ops) {
+    unsigned seed = 1;
+    int nlive = 0, npinned = 0, nbig = 0;
+    for (int op = 0; op < ops; ++op) {
+        if (npinned < PINNED_MAX && rand_r(&seed) % (ops / PINNED_MAX) == 0) {
+            void *q = alloc_pages_type(1, pinned_type);
+            if (!IS_ERR(q)) pinned[npinned++] = q;
+        } else if (nlive == LIVE_MAX || (nlive > 0 && rand_r(&seed) % 2 == 0)) {
+            int i = rand_r(&seed) % nlive;
+            return_pages(live[i]);
+            live[i] = live[--nlive];
+        } else {
+            void *q = alloc_pages(1 + rand_r(&seed) % 3);
+            if (!IS_ERR(q)) live[nlive++] = q;
+        }
+    }
+    while (nlive > 0) return_pages(live[--nlive]);
+    void *q;
+    while (!IS_ERR(q = alloc_pages(BIGRANK))) big[nbig++] = q;
+    // Why the next one fails: 0 = out of memory, 1000 = fragmentation.
+    int index = query_fragmentation_index(BIGRANK);
+    printf("%-12s %8d %14d %10d\n", name, npinned, nbig, index);
+    while (nbig > 0) return_pages(big[--nbig]);
+    while (npinned > 0) return_pages(pinned[--npinned]);
+}
+
+int main(int argc, char *argv[]) {
+    int ops = argc > 1 ? atoi(argv[1]) : DEFAULT_OPS;
+    void *p = malloc(TESTSIZE * 1024 * 1024);
+
+    printf("%-12s %8s %14s %10s\n", "grouping", "pinned", "rank-10 blocks", "frag(10)");
+    init_page(p, PGCOUNT);
+    run("none", MIGRATE_MOVABLE, ops);
+    init_page(p, PGCOUNT);
+    run("migratetype", MIGRATE_UNMOVABLE, ops);
+    free(p);
+    return 0;
+}
@@ -0,0 +1,285 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buddy.h"
+
+// Differential fuzzer: random alloc/return/bulk/exact/query sequences run
+// against buddy.c and against a reference model, a sorted map of the
+// allocated intervals. The model knows nothing about free lists: the free
+// pages between two intervals are cut greedily into the largest aligned
+// blocks that fit, which is exactly what an eagerly merging buddy
+// allocator keeps on its lists. The model keeps its free counts per rank
+// up to date by recounting only the gaps an operation changes. After
+// every operation, every query_page_counts() and a random query_ranks()
+// and query_block_head() must match the model, every block handed out
+// must be aligned and free in the model, and an allocation must fail iff
+// the model has no free block large enough. Each round uses a fresh pool
+// of a random size.
+
+#define MAX_PAGES 4096
+#define MAX_LIVE 4096
+#define ALLOC_RANK_MAX 13
+#define BULK_MAX 16
+#define DEFAULT_OPS 1000000
+#define OPS_PER_ROUND 20000
+
+struct interval {
+    int start, rank;
+};
+
+// The model: allocated blocks sorted by start, and their starts in
+// allocation order for picking a random one.
+struct interval map[MAX_LIVE];
+int nmap;
+int live[MAX_LIVE];
+int nlive;
+int pages;
+long free_count[MAX_RANK];
+
+uint8_t *pool;
+unsigned seed, round_seed;
+long op, round_start;
+
+// `fuzz <ops> <round seed>` replays the failing round first.
+void fail(const char *what) {
+    printf("[x] op %ld of round seed %u (%d pages): %s\n", op - round_start, round_seed, pages,
+           what);
+    exit(-1);
+}
+
+// Index of the first interval starting at or after `pfn`.
+int lower_bound(int pfn) {
+    int lo = 0, hi = nmap;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map[mid].start < pfn) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static inline int size_of(int rank) { return 1 << (rank - 1); }
+
+// Free gap [*from, *to) around `pfn`, or -1 if an interval holds it; then
+// *from is the index of that interval.
+int gap_of(int pfn, int *from, int *to) {
+    int i = lower_bound(pfn + 1);
+    if (i > 0 && map[i - 1].start + size_of(map[i - 1].rank) > pfn) {
+        *from = i - 1;
+        return -1;
+    }
+    *from = i > 0 ? map[i - 1].start + size_of(map[i - 1].rank) : 0;
+    *to = i < nmap ? map[i].start : pages;
+    return 0;
+}
+
+// The largest aligned block at `pfn` that ends by `to`.
+int greedy_rank(int pfn, int to) {
+    int rank = 32 - __builtin_clz(to - pfn);
+    if (pfn != 0 && __builtin_ctz(pfn) + 1 < rank) rank = __builtin_ctz(pfn) + 1;
+    return rank < MAX_RANK ? rank : MAX_RANK;
+}
+
+// Add `delta` to the free counts of the blocks the gap [from, to) is cut
+// into. Only the gaps an operation changes are recounted.
+void count_gap(int from, int to, int delta) {
+    while (from < to) {
+        int rank = greedy_rank(from, to);
+        free_count[rank - 1] += delta;
+        from += size_of(rank);
+    }
+}
+
+void model_reset() {
+    nmap = nlive = 0;
+    memset(free_count, 0, sizeof(free_count));
+    count_gap(0, pages, 1);
+}
+
+// What query_ranks() of `pfn` must answer.
+int model_rank(int pfn) {
+    int from, to;
+    if (gap_of(pfn, &from, &to) < 0) return map[from].rank;
+    for (;;) {
+        int rank = greedy_rank(from, to);
+        if (pfn < from + size_of(rank)) {
+            int align = pfn == from ? rank : __builtin_ctz(pfn - from) + 1;
+            return align < rank ? align : rank;
+        }
+        from += size_of(rank);
+    }
+}
+
+int model_largest() {
+    for (int rank = MAX_RANK; rank >= 1; rank--) {
+        if (free_count[rank - 1] > 0) return rank;
+    }
+    return 0;
+}
+
+void model_insert(void *p, int rank) {
+    if (p < (void *)pool) fail("block below the pool");
+    long diff = (uint8_t *)p - pool;
+    if (diff % PAGE_SIZE != 0) fail("block not page aligned");
+    int pfn = diff / PAGE_SIZE, from, to;
+    if (pfn + size_of(rank) > pages) fail("block beyond the pool");
+    if ((pfn & (size_of(rank) - 1)) != 0) fail("block not aligned to its rank");
+    if (gap_of(pfn, &from, &to) < 0 || pfn + size_of(rank) > to) fail("block overlaps a live one");
+    if (nlive == MAX_LIVE) fail("model full");
+    count_gap(from, to, -1);
+    count_gap(from, pfn, 1);
+    count_gap(pfn + size_of(rank), to, 1);
+    int i = lower_bound(pfn);
+    memmove(&map[i + 1], &map[i], sizeof(struct interval) * (nmap - i));
+    map[i] = (struct interval){pfn, rank};
+    nmap++;
+    live[nlive++] = pfn;
+}
+
+// Index in map[] of the live block at `pfn`, or -1.
+int model_find(int pfn) {
+    int i = lower_bound(pfn);
+    return i < nmap && map[i].start == pfn ? i : -1;
+}
+
+void model_remove(int k) {
+    int i = model_find(live[k]);
+    int from = i > 0 ? map[i - 1].start + size_of(map[i - 1].rank) : 0;
+    int end = map[i].start + size_of(map[i].rank), to = i + 1 < nmap ? map[i + 1].start : pages;
+    count_gap(from, map[i].start, -1);
+    count_gap(end, to, -1);
+    count_gap(from, to, 1);
+    memmove(&map[i], &map[i + 1], sizeof(struct interval) * (nmap - i - 1));
+    nmap--;
+    live[k] = live[--nlive];
+}
+
+void *page(int pfn) { return pool + (size_t)pfn * PAGE_SIZE; }
+
+int random_rank() {
+    return rand_r(&seed) % 100 < 70 ? 1 + rand_r(&seed) % 3 : 1 + rand_r(&seed) % ALLOC_RANK_MAX;
+}
+
+void do_alloc() {
+    int rank = random_rank();
+    void *p = rand_r(&seed) % 4 == 0 ? alloc_pages_type(rank, rand_r(&seed) % MIGRATE_TYPES)
+                                     : alloc_pages(rank);
+    if (IS_ERR(p)) {
+        if (PTR_ERR(p) != -ENOSPC) fail("unexpected alloc error");
+        if (model_largest() >= rank) fail("alloc failed with a large enough free block");
+        return;
+    }
+    model_insert(p, rank);
+}
+
+void do_return() {
+    int k = rand_r(&seed) % nlive;
+    if (return_pages(page(live[k])) != OK) fail("return_pages of a live block failed");
+    model_remove(k);
+}
+
+// Free a page that is not the head of a live block.
+void do_bad_return() {
+    int pfn = rand_r(&seed) % (pages + 1);
+    if (model_find(pfn) >= 0) return;
+    void *p = page(pfn);
+    if (rand_r(&seed) % 4 == 0) p = (uint8_t *)p + 8;
+    if (return_pages(p) != -EINVAL) fail("bogus return_pages accepted");
+}
+
+void do_bulk_alloc() {
+    void *out[BULK_MAX];
+    int rank = 1 + rand_r(&seed) % 3, n = 1 + rand_r(&seed) % BULK_MAX;
+    int got = alloc_pages_bulk(rank, n, out);
+    if (got < 0 || got > n) fail("alloc_pages_bulk count out of range");
+    for (int i = 0; i < got; i++) model_insert(out[i], rank);
+    if (got < n && model_largest() >= rank) fail("alloc_pages_bulk stopped short");
+}
+
+void do_bulk_return() {
+    void *in[BULK_MAX + 1];
+    int n = 0, want = 1 + rand_r(&seed) % BULK_MAX;
+    while (n < want && nlive > 0) {
+        int k = rand_r(&seed) % nlive;
+        in[n++] = page(live[k]);
+        model_remove(k);
+    }
+    int bogus = rand_r(&seed) % 8 == 0;
+    if (bogus) in[n++] = pool + 8;
+    if (return_pages_bulk(in, n) != (bogus ? -EINVAL : OK)) fail("return_pages_bulk result");
+}
+
+// The pieces of an exact allocation become live blocks of their own.
+void do_exact() {
+    int n = 1 + rand_r(&seed) % 40, rank = n == 1 ? 1 : 33 - __builtin_clz(n - 1);
+    uint8_t *p = alloc_pages_exact(n);
+    if (IS_ERR(p)) {
+        if (PTR_ERR(p) != -ENOSPC) fail("unexpected alloc_pages_exact error");
+        if (model_largest() >= rank) fail("alloc_pages_exact failed with a large enough block");
+        return;
+    }
+    for (int bit = 31 - __builtin_clz(n); bit >= 0; bit--) {
+        if ((n & (1 << bit)) == 0) continue;
+        model_insert(p, bit + 1);
+        p += (size_t)PAGE_SIZE << bit;
+    }
+}
+
+void check() {
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        if (query_page_counts(rank) != free_count[rank - 1]) fail("query_page_counts mismatch");
+    }
+    int pfn = rand_r(&seed) % pages;
+    if (query_ranks(page(pfn)) != model_rank(pfn)) fail("query_ranks mismatch");
+    int from, to;
+    void *head = query_block_head(page(pfn));
+    if (gap_of(pfn, &from, &to) < 0) {
+        if (head != page(map[from].start)) fail("query_block_head of an allocated page");
+    } else if (PTR_ERR(head) != -EINVAL) {
+        fail("query_block_head of a free page");
+    }
+    if (query_ranks(page(pages)) != -EINVAL) fail("query_ranks beyond the pool");
+}
+
+int main(int argc, char *argv[]) {
+    long ops = argc > 1 ? atol(argv[1]) : DEFAULT_OPS;
+    unsigned base = argc > 2 ? atoi(argv[2]) : 1;
+    pool = malloc((size_t)(MAX_PAGES + 1) * PAGE_SIZE);
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long round = 0; op < ops; round++) {
+        seed = round_seed = base + round;
+        round_start = op;
+        pages = 1 + rand_r(&seed) % MAX_PAGES;
+        init_page(pool, pages);
+        model_reset();
+        for (long end = op + OPS_PER_ROUND; op < end && op < ops; op++) {
+            int what = rand_r(&seed) % 100;
+            if (what < 45 || nlive == 0) {
+                do_alloc();
+            } else if (what < 88) {
+                do_return();
+            } else if (what < 92) {
+                do_bad_return();
+            } else if (what < 95) {
+                do_bulk_alloc();
+            } else if (what < 98) {
+                do_bulk_return();
+            } else {
+                do_exact();
+            }
+            check();
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double secs = stop.tv_sec - start.tv_sec + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    printf("fuzz: %ld ops, %.0f ops/s Ok\n", ops, ops / secs);
+    free(pool);
+    return 0;
+}
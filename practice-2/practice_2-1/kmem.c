@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "slab.h"
+#include "utils.h"
+int fake_mode = 0;
+int cont = 0;
+
+// Object caches on top of the buddy allocator.
+
+#define MAXRANK (16)
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+#define NOBJ (20000)
+int tCnt = 0;
+
+void *objs[NOBJ];
+
+int main() {
+    void *p;
+    int i;
+    struct kmem_cache *c;
+
+    printf("Slab test suite: \n");
+    // Not page aligned on purpose.
+    p = malloc(TESTSIZE * 1024 * 1024 + 16) + 16;
+    init_page(p, PGCOUNT);
+    {
+        printf("Phase 1: cache geometry\n");
+        ok(PTR_ERR(kmem_cache_create(0, 0)) == -EINVAL);
+        ok(PTR_ERR(kmem_cache_create(64, 48)) == -EINVAL);
+        c = kmem_cache_create(64, 0);
+        ok(!IS_ERR(c) && c->rank == 1 && c->objs >= 60);
+        kmem_cache_destroy(c);
+        c = kmem_cache_create(3000, 0);
+        ok(!IS_ERR(c) && c->rank == 4 && c->objs >= 8);
+        kmem_cache_destroy(c);
+    }
+    {
+        printf("Phase 2: alloc and free objects\n");
+        tCnt = 0;
+        c = kmem_cache_create(192, 64);
+        for (i = 0; i < NOBJ; i++) {
+            objs[i] = kmem_cache_alloc(c);
+            dotOk(!IS_ERR(objs[i]) && ((uintptr_t)objs[i] & 63) == 0);
+            memset(objs[i], i & 0xff, 192);
+        }
+        dotDone();
+        ok(c->nr_objs == NOBJ);
+        ok(c->nr_slabs == (NOBJ + c->objs - 1) / c->objs);
+        tCnt = 0;
+        for (i = 0; i < NOBJ; i++) {
+            unsigned char *o = objs[i];
+            dotOk(o[0] == (i & 0xff) && o[191] == (i & 0xff));
+        }
+        dotDone();
+        ok(kmem_cache_free(c, objs[0]) == OK);
+        ok(kmem_cache_free(c, objs[0]) == -EINVAL);
+        ok(kmem_cache_free(c, (char *)objs[1] + 8) == -EINVAL);
+        ok(kmem_cache_alloc(c) == objs[0]);
+        for (i = 0; i < NOBJ; i++) {
+            kmem_cache_free(c, objs[i]);
+        }
+        ok(c->nr_objs == 0);
+        ok(c->nr_slabs == KMEM_EMPTY_MAX && c->nr_empty == KMEM_EMPTY_MAX);
+        ok(kmem_cache_shrink(c) == KMEM_EMPTY_MAX);
+        ok(query_page_counts(MAXRANK) == 1);
+    }
+    {
+        printf("Phase 3: caches do not mix\n");
+        tCnt = 0;
+        struct kmem_cache *d = kmem_cache_create(64, 0);
+        void *x = kmem_cache_alloc(c), *y = kmem_cache_alloc(d);
+        ok(kmem_cache_free(d, x) == -EINVAL);
+        ok(kmem_cache_free(c, y) == -EINVAL);
+        ok(kmem_cache_free(c, x) == OK);
+        ok(kmem_cache_free(d, y) == OK);
+        kmem_cache_destroy(c);
+        kmem_cache_destroy(d);
+        ok(query_page_counts(MAXRANK) == 1);
+    }
+    free(p - 16);
+    finish();
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+#include "slab.h"
+
+// Small-object churn, 64 to 512 bytes: one rank-1 page per object versus
+// object caches. Reports ns per alloc/free pair and the pages in use at
+// the peak.
+
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+#define LIVE 8192
+#define DEFAULT_OPS 4000000
+
+void *live[LIVE];
+int live_size[LIVE];
+
+int sizes[] = {64, 128, 256, 512};
+#define NSIZE (int)(sizeof(sizes) / sizeof(sizes[0]))
+struct kmem_cache *caches[NSIZE];
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long free_pages() {
+    long count = 0;
+    for (int rank = 1; rank <= 16; ++rank) count += (long)query_page_counts(rank) << (rank - 1);
+    return count;
+}
+
+void *obj_alloc(int slab, int s) { return slab ? kmem_cache_alloc(caches[s]) : alloc_pages(1); }
+
+void obj_free(int slab, int s, void *obj) {
+    if (slab) {
+        kmem_cache_free(caches[s], obj);
+    } else {
+        return_pages(obj);
+    }
+}
+
+void run(const char *name, int slab, int ops) {
+    unsigned seed = 1;
+    long peak = 0;
+    for (int i = 0; i < LIVE; ++i) {
+        live_size[i] = rand_r(&seed) % NSIZE;
+        live[i] = obj_alloc(slab, live_size[i]);
+    }
+    double start = now();
+    for (int op = 0; op < ops; ++op) {
+        int i = rand_r(&seed) % LIVE;
+        obj_free(slab, live_size[i], live[i]);
+        live_size[i] = rand_r(&seed) % NSIZE;
+        live[i] = obj_alloc(slab, live_size[i]);
+        if (op % 65536 == 0 && PGCOUNT - free_pages() > peak) peak = PGCOUNT - free_pages();
+    }
+    double secs = now() - start;
+    printf("%-8s %12.1f %12ld\n", name, secs * 1e9 / ops, peak);
+    for (int i = 0; i < LIVE; ++i) obj_free(slab, live_size[i], live[i]);
+}
+
+int main(int argc, char *argv[]) {
+    int ops = argc > 1 ? atoi(argv[1]) : DEFAULT_OPS;
+    void *p = malloc(TESTSIZE * 1024 * 1024);
+    init_page(p, PGCOUNT);
+    for (int s = 0; s < NSIZE; ++s) caches[s] = kmem_cache_create(sizes[s], 0);
+
+    printf("%-8s %12s %12s\n", "objects", "ns/op", "peak pages");
+    run("pages", 0, ops);
+    run("slab", 1, ops);
+    for (int s = 0; s < NSIZE; ++s) kmem_cache_destroy(caches[s]);
+    free(p);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "utils.h"
+int fake_mode = 0;
+int cont = 0;
+
+// Lazy coalescing: frees of small blocks are not merged until a pass.
+
+#define MAXRANK (16)
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+int tCnt = 0;
+
+int main() {
+    void *p, *q, *r;
+    int pgIdx;
+
+    printf("Lazy coalescing test suite: \n");
+    p = malloc(TESTSIZE * 1024 * 1024);
+    {
+        printf("Phase 1: frees are not merged\n");
+        ok(init_page(p, PGCOUNT) == OK);
+        ok(buddy_lazy_setup(-1, 0) == -EINVAL);
+        ok(buddy_lazy_setup(3, 0) == OK);
+        q = alloc_pages(1);
+        r = alloc_pages(1);
+        ok(q == p && r == p + PAGE_SIZE);
+        ok(return_pages(q) == OK);
+        ok(return_pages(r) == OK);
+        ok(query_page_counts(1) == 2);
+        ok(query_page_counts(MAXRANK) == 0);
+        // The ping-pong reuses the unmerged block without splitting.
+        ok(alloc_pages(1) == r);
+        ok(return_pages(r) == OK);
+        buddy_coalesce();
+        ok(query_page_counts(1) == 0);
+        ok(query_page_counts(MAXRANK) == 1);
+    }
+    {
+        printf("Phase 2: a failing allocation merges\n");
+        tCnt = 0;
+        for (pgIdx = 0; pgIdx < PGCOUNT; pgIdx++) {
+            dotOk(alloc_pages(1) == p + (size_t)pgIdx * PAGE_SIZE);
+        }
+        dotDone();
+        for (pgIdx = 0; pgIdx < PGCOUNT; pgIdx++) {
+            return_pages(p + (size_t)pgIdx * PAGE_SIZE);
+        }
+        // Ranks above 3 still merge eagerly, as soon as a pass gets there.
+        ok(query_page_counts(1) == PGCOUNT);
+        r = alloc_pages(MAXRANK);
+        ok(r == p);
+        ok(query_page_counts(1) == 0);
+        ok(return_pages(r) == OK);
+    }
+    {
+        printf("Phase 3: a pass every `threshold` frees\n");
+        tCnt = 0;
+        ok(buddy_lazy_setup(3, 4) == OK);
+        void *pages[4];
+        for (pgIdx = 0; pgIdx < 4; pgIdx++) pages[pgIdx] = alloc_pages(1);
+        for (pgIdx = 0; pgIdx < 3; pgIdx++) return_pages(pages[pgIdx]);
+        ok(query_page_counts(1) == 3);
+        return_pages(pages[3]);
+        ok(query_page_counts(1) == 0);
+        ok(query_page_counts(MAXRANK) == 1);
+        // Turning it off merges what is left.
+        q = alloc_pages(1);
+        ok(return_pages(q) == OK);
+        ok(query_page_counts(1) == 2);
+        ok(buddy_lazy_setup(0, 0) == OK);
+        ok(query_page_counts(MAXRANK) == 1);
+    }
+    free(p);
+    finish();
+
+    return 0;
+}
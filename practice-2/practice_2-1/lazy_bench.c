@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+
+// Eager merging versus lazy coalescing on two single-threaded patterns:
+// bursts of allocations freed right away (ping-pong), and random churn.
+// Reports ops/s and, as a measure of fragmentation, the number of free
+// blocks on the lists at the end of the run (eagerly merged, the pool
+// minus what is live takes the fewest blocks possible).
+
+#define MAXRANK (16)
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+#define BURST 64
+#define LIVE 4096
+#define DEFAULT_OPS 4000000
+
+void *pages[LIVE];
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long free_blocks() {
+    long count = 0;
+    for (int rank = 1; rank <= MAXRANK; ++rank) count += query_page_counts(rank);
+    return count;
+}
+
+void report(const char *pattern, const char *mode, int ops, double secs) {
+    printf("%-10s %-12s %14.0f %12ld\n", pattern, mode, ops / secs, free_blocks());
+}
+
+void ping_pong(const char *mode, int ops) {
+    unsigned seed = 1;
+    double start = now();
+    for (int op = 0; op < ops; op += 2 * BURST) {
+        int rank = 1 + rand_r(&seed) % 3;
+        for (int i = 0; i < BURST; ++i) pages[i] = alloc_pages(rank);
+        for (int i = 0; i < BURST; ++i) return_pages(pages[i]);
+    }
+    report("ping-pong", mode, ops, now() - start);
+}
+
+void churn(const char *mode, int ops) {
+    unsigned seed = 1;
+    for (int i = 0; i < LIVE; ++i) pages[i] = alloc_pages(1 + rand_r(&seed) % 3);
+    double start = now();
+    for (int op = 0; op < ops; op += 2) {
+        int i = rand_r(&seed) % LIVE;
+        return_pages(pages[i]);
+        pages[i] = alloc_pages(1 + rand_r(&seed) % 3);
+    }
+    report("churn", mode, ops, now() - start);
+    for (int i = 0; i < LIVE; ++i) return_pages(pages[i]);
+}
+
+int main(int argc, char *argv[]) {
+    int ops = argc > 1 ? atoi(argv[1]) : DEFAULT_OPS;
+    void *p = malloc(TESTSIZE * 1024 * 1024);
+    struct {
+        const char *name;
+        int rank, threshold;
+    } modes[] = {{"eager", 0, 0}, {"lazy", 3, 0}, {"lazy/4096", 3, 4096}};
+
+    printf("%-10s %-12s %14s %12s\n", "pattern", "merging", "ops/s", "free blocks");
+    for (int m = 0; m < 3; ++m) {
+        init_page(p, PGCOUNT);
+        buddy_lazy_setup(modes[m].rank, modes[m].threshold);
+        ping_pong(modes[m].name, ops);
+        churn(modes[m].name, ops);
+        buddy_lazy_setup(0, 0);
+        if (query_page_counts(MAXRANK) != 1) printf("[x] pool not fully merged\n");
+    }
+    free(p);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "utils.h"
+int fake_mode = 0;
+int cont = 0;
+
+// Migrate type grouping, stealing between types, and the fragmentation
+// index.
+
+#define MAXRANK (16)
+#define PGCOUNT (32768)
+#define BLOCKPAGES (512)
+int tCnt = 0;
+
+int main() {
+    void *p, *q, *r;
+    int pgIdx;
+    static void *pages[PGCOUNT];
+
+    printf("Migrate type test suite: \n");
+    {
+        printf("Phase 1: unmovable pages share a pageblock\n");
+        p = malloc((size_t)PGCOUNT * PAGE_SIZE);
+        ok(init_page(p, PGCOUNT) == OK);
+        ok(PTR_ERR(alloc_pages_type(1, MIGRATE_TYPES)) == -EINVAL);
+        ok(PTR_ERR(alloc_pages_type(1, -1)) == -EINVAL);
+        q = alloc_pages_type(1, MIGRATE_UNMOVABLE);
+        ok(q == p);
+        r = alloc_pages(1);
+        ok(r == p + BLOCKPAGES * PAGE_SIZE);
+        tCnt = 0;
+        for (pgIdx = 1; pgIdx < BLOCKPAGES; pgIdx++) {
+            pages[pgIdx] = alloc_pages_type(1, MIGRATE_UNMOVABLE);
+            dotOk(pages[pgIdx] > q && pages[pgIdx] < p + BLOCKPAGES * PAGE_SIZE);
+        }
+        dotDone();
+        // The first pageblock is full: the next one is stolen whole.
+        q = alloc_pages_type(1, MIGRATE_RECLAIMABLE);
+        ok(((q - p) / PAGE_SIZE) % BLOCKPAGES == 0 && q != r);
+        ok(alloc_pages_type(1, MIGRATE_RECLAIMABLE) == q + PAGE_SIZE);
+        ok(return_pages(q + PAGE_SIZE) == OK);
+        ok(return_pages(q) == OK);
+        for (pgIdx = 1; pgIdx < BLOCKPAGES; pgIdx++) {
+            return_pages(pages[pgIdx]);
+        }
+        ok(return_pages(p) == OK);
+        ok(return_pages(r) == OK);
+        ok(query_page_counts(MAXRANK) == 1);
+        // Freed pages merge across pageblocks of different types, and a
+        // large allocation takes its pageblocks over.
+        r = alloc_pages(MAXRANK);
+        ok(r == p);
+        ok(return_pages(r) == OK);
+        ok(alloc_pages(1) == p);
+        ok(return_pages(p) == OK);
+    }
+    {
+        printf("Phase 2: fragmentation index\n");
+        tCnt = 0;
+        ok(init_page(p, 1024) == OK);
+        ok(query_fragmentation_index(11) == -1000);
+        ok(query_fragmentation_index(0) == -EINVAL);
+        for (pgIdx = 0; pgIdx < 1024; pgIdx++) {
+            pages[pgIdx] = alloc_pages(1);
+        }
+        // Nothing free: failures are due to lack of memory.
+        ok(query_fragmentation_index(1) == 0);
+        for (pgIdx = 0; pgIdx < 1024; pgIdx += 2) {
+            return_pages(pages[pgIdx]);
+        }
+        ok(query_fragmentation_index(1) == -1000);
+        // 512 free single pages: 1000 - (1000 + 512 * 1000 / 2) / 512
+        ok(query_fragmentation_index(2) == 499);
+        ok(query_fragmentation_index(11) > 990);
+        for (pgIdx = 1; pgIdx < 1024; pgIdx += 2) {
+            return_pages(pages[pgIdx]);
+        }
+        ok(query_page_counts(11) == 1);
+        free(p);
+    }
+    finish();
+
+    return 0;
+}
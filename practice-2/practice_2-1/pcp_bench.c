@@ -0,0 +1,78 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+// Hammer rank-1 and rank-2 alloc/return from 1..N threads, with the
+// per-CPU page caches off and on.
+
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+#define BURST 16
+#define DEFAULT_ROUNDS 20000
+
+int rounds;
+pthread_barrier_t barrier;
+
+void *worker(void *arg) {
+    unsigned seed = (unsigned long)arg;
+    void *pages[BURST];
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < rounds; ++i) {
+        for (int j = 0; j < BURST; ++j) {
+            pages[j] = alloc_pages(1 + (rand_r(&seed) & 1));
+            if (IS_ERR(pages[j])) {
+                printf("[x] alloc_pages failed: %ld\n", PTR_ERR(pages[j]));
+                exit(-1);
+            }
+        }
+        for (int j = 0; j < BURST; ++j) {
+            return_pages(pages[j]);
+        }
+    }
+    return NULL;
+}
+
+double run(int nthread) {
+    pthread_t pid[nthread];
+    struct timeval start, stop;
+    pthread_barrier_init(&barrier, NULL, nthread + 1);
+    for (int i = 0; i < nthread; ++i) {
+        pthread_create(&pid[i], NULL, worker, (void *)(long)(i + 1));
+    }
+    gettimeofday(&start, NULL);
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < nthread; ++i) {
+        pthread_join(pid[i], NULL);
+    }
+    gettimeofday(&stop, NULL);
+    pthread_barrier_destroy(&barrier);
+    double secs = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+    return 2.0 * BURST * rounds * nthread / secs;
+}
+
+int main(int argc, char *argv[]) {
+    int max_thread = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+    void *p = malloc(TESTSIZE * 1024 * 1024);
+    init_page(p, PGCOUNT);
+
+    printf("%-8s %16s %16s\n", "threads", "no pcp (ops/s)", "pcp (ops/s)");
+    for (int n = 1; n <= max_thread; n *= 2) {
+        buddy_pcp_setup(0, 0);
+        double plain = run(n);
+        buddy_pcp_setup(2 * BURST, 4 * BURST);
+        double cached = run(n);
+        printf("%-8d %16.0f %16.0f\n", n, plain, cached);
+    }
+    buddy_pcp_setup(0, 0);
+    if (query_page_counts(16) != 1) {
+        printf("[x] pages leaked\n");
+        return -1;
+    }
+    free(p);
+    return 0;
+}
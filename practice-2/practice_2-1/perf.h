@@ -0,0 +1,50 @@
+#ifndef OS_PERF_H
+#define OS_PERF_H
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Thin wrappers around perf_event_open(2) for the benchmarks. A counter
+// covers the calling thread only; perf_open() returns -1 where counters
+// are not available (containers, perf_event_paranoid), and the other
+// calls then do nothing.
+
+#define PERF_DTLB_MISS                                                  \
+    (PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |   \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static inline int perf_open(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static inline void perf_start(int fd) {
+    if (fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// Stop the counter and return its value, or -1.
+static inline long long perf_stop(int fd) {
+    long long count;
+    if (fd < 0) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+}
+
+static inline void perf_close(int fd) {
+    if (fd >= 0) close(fd);
+}
+
+#endif
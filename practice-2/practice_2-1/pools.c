@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "utils.h"
+int fake_mode = 0;
+int cont = 0;
+
+// Independent pools next to the default one, with their metadata in a
+// caller buffer or inside the pool.
+
+#define POOLPAGES (1024)
+#define SMALLPAGES (16)
+int tCnt = 0;
+
+int main() {
+    void *p, *q, *d, *r, *s;
+    void *meta1, *meta2;
+    struct buddy_pool *a, *b;
+    int pgIdx, n;
+
+    printf("Pool test suite: \n");
+    {
+        printf("Phase 1: metadata in a caller buffer\n");
+        p = malloc((size_t)POOLPAGES * PAGE_SIZE);
+        q = malloc((size_t)POOLPAGES * PAGE_SIZE);
+        d = malloc((size_t)POOLPAGES * PAGE_SIZE);
+        ok(init_page(d, POOLPAGES) == OK);
+        meta1 = malloc(buddy_pool_meta_size(POOLPAGES));
+        meta2 = malloc(buddy_pool_meta_size(POOLPAGES));
+        a = buddy_pool_create(p, POOLPAGES, meta1);
+        b = buddy_pool_create(q, POOLPAGES, meta2);
+        ok(!IS_ERR(a) && !IS_ERR(b));
+        ok(buddy_pool_page_counts(a, 11) == 1 && buddy_pool_page_counts(b, 11) == 1);
+        r = buddy_pool_alloc(a, 1, MIGRATE_MOVABLE);
+        s = buddy_pool_alloc(b, 3, MIGRATE_UNMOVABLE);
+        ok(r == p && s == q);
+        ok(buddy_pool_query_ranks(a, r) == 1 && buddy_pool_query_ranks(b, s) == 3);
+        ok(buddy_pool_page_counts(a, 11) == 0 && buddy_pool_page_counts(a, 10) == 1);
+        // Neither the other pool nor the default one knows the block.
+        ok(buddy_pool_free(b, r) == -EINVAL);
+        ok(return_pages(r) == -EINVAL);
+        ok(query_ranks(r) == -EINVAL);
+        ok(query_page_counts(11) == 1);
+        ok(buddy_pool_free(a, r) == OK);
+        ok(buddy_pool_free(a, r) == -EINVAL);
+        ok(buddy_pool_free(b, s) == OK);
+        ok(buddy_pool_page_counts(a, 11) == 1 && buddy_pool_page_counts(b, 11) == 1);
+        ok(PTR_ERR(buddy_pool_alloc(a, 12, MIGRATE_MOVABLE)) == -ENOSPC);
+        ok(PTR_ERR(buddy_pool_alloc(a, 0, MIGRATE_MOVABLE)) == -EINVAL);
+        buddy_pool_destroy(a);
+        buddy_pool_destroy(b);
+        free(meta1);
+        free(meta2);
+    }
+    {
+        printf("Phase 2: metadata inside the pool\n");
+        tCnt = 0;
+        ok(buddy_pool_meta_size(SMALLPAGES) < PAGE_SIZE);
+        a = buddy_pool_create(p, SMALLPAGES, NULL);
+        ok(!IS_ERR(a));
+        n = SMALLPAGES - (buddy_pool_meta_size(SMALLPAGES) + PAGE_SIZE - 1) / PAGE_SIZE;
+        for (pgIdx = 0; pgIdx < n; pgIdx++) {
+            // Every page before the metadata, and none of it.
+            r = buddy_pool_alloc(a, 1, MIGRATE_MOVABLE);
+            dotOk(!IS_ERR(r) && r >= p && r < p + (size_t)n * PAGE_SIZE);
+        }
+        dotDone();
+        ok(PTR_ERR(buddy_pool_alloc(a, 1, MIGRATE_MOVABLE)) == -ENOSPC);
+        ok(buddy_pool_query_ranks(a, p + (size_t)n * PAGE_SIZE) == -EINVAL);
+        for (pgIdx = 0; pgIdx < n; pgIdx++) {
+            dotOk(buddy_pool_free(a, p + (size_t)pgIdx * PAGE_SIZE) == OK);
+        }
+        dotDone();
+        ok(buddy_pool_page_counts(a, 1) + 2 * buddy_pool_page_counts(a, 2) +
+               4 * buddy_pool_page_counts(a, 3) + 8 * buddy_pool_page_counts(a, 4) ==
+           n);
+        buddy_pool_destroy(a);
+    }
+    {
+        printf("Phase 3: bad arguments\n");
+        tCnt = 0;
+        ok(PTR_ERR(buddy_pool_create(p, 1, NULL)) == -ENOMEM);
+        ok(PTR_ERR(buddy_pool_create(p, POOLPAGES, p + PAGE_SIZE)) == -EINVAL);
+        ok(PTR_ERR(buddy_pool_create(NULL, POOLPAGES, q)) == -EINVAL);
+        ok(buddy_pool_meta_size(0) == 0);
+        ok(return_pages(d) == -EINVAL);
+        r = alloc_pages(1);
+        ok(r == d && return_pages(r) == OK);
+    }
+    free(d);
+    free(q);
+    free(p);
+    finish();
+
+    return 0;
+}
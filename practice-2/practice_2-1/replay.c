@@ -0,0 +1,322 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+// Replays alloc/return traces against alloc_pages()/return_pages(), in
+// the spirit of the malloc lab's .rep files:
+//
+//     <pool pages>
+//     <number of ids>
+//     <number of ops>
+//     a <id> <rank>      allocate a block of <rank> as <id>
+//     f <id>             return the block of <id>
+//
+// A first pass checks that no two live blocks overlap, and records the
+// failed allocations and the peak fragmentation: the share of free pages
+// in blocks too small for the largest rank the trace asks for (Linux's
+// unusable free space index). A second pass is timed.
+// Instead of reading files, -g generates a trace with ranks drawn
+// uniformly or from a Zipf distribution, and a mix of short-lived and
+// long-lived blocks; -w prints it instead of replaying it.
+
+#define DEFAULT_PAGES (128 * 1024 / 4)
+#define DEFAULT_ALLOCS 200000
+#define DEFAULT_MAXRANK 6
+#define SHORT_LIFE 64    // a short-lived block is freed within this many allocations
+#define LONG_LIFE 256    // a long-lived one lives at least this many
+#define LONG_LIFE_MAX 4096
+
+struct op {
+    char type;
+    int id, rank;
+};
+
+struct trace {
+    int pages, ids, nops;
+    struct op *ops;
+};
+
+struct live {
+    uint64_t *p;
+    int rank;
+};
+
+int errors;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void error(const char *name, int op, const char *what) {
+    printf("[x] %s: op %d: %s\n", name, op, what);
+    errors++;
+}
+
+// The next line of `f` into buf, counting lines in *line.
+int next_line(FILE *f, char *buf, int len, int *line) {
+    if (fgets(buf, len, f) == NULL) return -1;
+    (*line)++;
+    return 0;
+}
+
+int trace_error(const char *name, int line, const char *what) {
+    printf("[x] %s:%d: %s\n", name, line, what);
+    return -1;
+}
+
+// One header value or op per line.
+int read_trace(FILE *f, const char *name, struct trace *t) {
+    char buf[256];
+    int line = 0;
+    int *header[3] = {&t->pages, &t->ids, &t->nops};
+    for (int i = 0; i < 3; i++) {
+        if (next_line(f, buf, sizeof(buf), &line) != 0)
+            return trace_error(name, line + 1, "short header");
+        if (sscanf(buf, "%d", header[i]) != 1) return trace_error(name, line, "bad header");
+    }
+    if (t->pages <= 0 || t->ids <= 0 || t->nops < 0) return trace_error(name, line, "bad header");
+    t->ops = malloc(sizeof(struct op) * (t->nops > 0 ? t->nops : 1));
+    for (int i = 0; i < t->nops; i++) {
+        struct op *o = &t->ops[i];
+        o->rank = 0;
+        if (next_line(f, buf, sizeof(buf), &line) != 0)
+            return trace_error(name, line + 1, "missing ops");
+        if (sscanf(buf, " %c %d %d", &o->type, &o->id, &o->rank) < 2 ||
+            (o->type != 'a' && o->type != 'f'))
+            return trace_error(name, line, "bad op");
+        if (o->id < 0 || o->id >= t->ids) return trace_error(name, line, "id out of range");
+        if (o->type == 'a' && (o->rank < 1 || o->rank > MAX_RANK))
+            return trace_error(name, line, "rank out of range");
+    }
+    return 0;
+}
+
+void write_trace(FILE *f, struct trace *t) {
+    fprintf(f, "%d\n%d\n%d\n", t->pages, t->ids, t->nops);
+    for (int i = 0; i < t->nops; i++) {
+        if (t->ops[i].type == 'a') {
+            fprintf(f, "a %d %d\n", t->ops[i].id, t->ops[i].rank);
+        } else {
+            fprintf(f, "f %d\n", t->ops[i].id);
+        }
+    }
+}
+
+// Pending frees of the generator, a min-heap on the allocation count at
+// which they are due.
+struct due {
+    int when, id;
+};
+
+void heap_push(struct due *heap, int *n, struct due d) {
+    int i = (*n)++;
+    for (; i > 0 && heap[(i - 1) / 2].when > d.when; i = (i - 1) / 2) heap[i] = heap[(i - 1) / 2];
+    heap[i] = d;
+}
+
+struct due heap_pop(struct due *heap, int *n) {
+    struct due top = heap[0], last = heap[--*n];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= *n) break;
+        if (c + 1 < *n && heap[c + 1].when < heap[c].when) c++;
+        if (heap[c].when >= last.when) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+// `allocs` allocations of ranks 1..maxrank, uniform or with P(r) ~ 1/r,
+// of which long_pct percent are long-lived. Every block is returned.
+void generate(struct trace *t, int zipf, int allocs, int maxrank, int long_pct, unsigned seed,
+              int pages) {
+    double cdf[MAX_RANK], sum = 0;
+    for (int r = 1; r <= maxrank; r++) cdf[r - 1] = sum += zipf ? 1.0 / r : 1.0;
+    struct due *heap = malloc(sizeof(struct due) * allocs);
+    int nheap = 0;
+    t->pages = pages;
+    t->ids = allocs;
+    t->nops = 0;
+    t->ops = malloc(sizeof(struct op) * 2 * allocs);
+    for (int id = 0; id < allocs; id++) {
+        while (nheap > 0 && heap[0].when <= id) {
+            t->ops[t->nops++] = (struct op){'f', heap_pop(heap, &nheap).id, 0};
+        }
+        double x = (double)rand_r(&seed) / ((double)RAND_MAX + 1) * sum;
+        int rank = 1;
+        while (rank < maxrank && x >= cdf[rank - 1]) rank++;
+        t->ops[t->nops++] = (struct op){'a', id, rank};
+        int life = rand_r(&seed) % 100 < long_pct
+                       ? LONG_LIFE + rand_r(&seed) % (LONG_LIFE_MAX - LONG_LIFE)
+                       : 1 + rand_r(&seed) % SHORT_LIFE;
+        heap_push(heap, &nheap, (struct due){id + life, id});
+    }
+    while (nheap > 0) t->ops[t->nops++] = (struct op){'f', heap_pop(heap, &nheap).id, 0};
+    free(heap);
+}
+
+// Share of free pages in blocks of rank < `rank`, in percent.
+double fragmentation(int rank) {
+    long free_pages = 0, usable = 0;
+    for (int r = 1; r <= MAX_RANK; r++) {
+        long pages = (long)query_page_counts(r) << (r - 1);
+        free_pages += pages;
+        if (r >= rank) usable += pages;
+    }
+    return free_pages > 0 ? 100.0 * (free_pages - usable) / free_pages : 0;
+}
+
+// Record `owner` (an id + 1, or 0 for none) for the pages of `b`. Returns
+// -1 if `b` is outside the pool or, when taking pages, if one of them
+// belongs to a live block already.
+int own(int *owners, struct trace *t, void *pool, struct live *b, int owner) {
+    long first = ((uint8_t *)b->p - (uint8_t *)pool) / PAGE_SIZE, size = 1L << (b->rank - 1);
+    if ((uint8_t *)b->p < (uint8_t *)pool || first + size > t->pages) return -1;
+    for (long pfn = first; pfn < first + size; pfn++) {
+        if (owner != 0 && owners[pfn] != 0) return -1;
+    }
+    for (long pfn = first; pfn < first + size; pfn++) owners[pfn] = owner;
+    return 0;
+}
+
+uint64_t stamp(struct live *b, int id) { return (uintptr_t)b->p ^ ((uint64_t)id << 32) ^ b->rank; }
+
+void replay(const char *name, struct trace *t) {
+    void *pool = map_pool(t->pages, POOL_SMALL);
+    if (IS_ERR(pool)) {
+        printf("[x] %s: cannot map %d pages\n", name, t->pages);
+        errors++;
+        return;
+    }
+    struct live *live = calloc(t->ids, sizeof(struct live));
+    int *owners = calloc(t->pages, sizeof(int));
+    int failures = 0, maxrank = 1;
+    double peak = 0;
+    for (int i = 0; i < t->nops; i++) {
+        if (t->ops[i].rank > maxrank) maxrank = t->ops[i].rank;
+    }
+
+    // Checked pass.
+    init_page(pool, t->pages);
+    for (int i = 0; i < t->nops; i++) {
+        struct op *o = &t->ops[i];
+        struct live *b = &live[o->id];
+        if (o->type == 'a') {
+            if (b->p != NULL) error(name, i, "id allocated twice");
+            b->rank = o->rank;
+            b->p = alloc_pages(o->rank);
+            if (IS_ERR(b->p)) {
+                if (PTR_ERR(b->p) != -ENOSPC) error(name, i, "unexpected alloc error");
+                failures++;
+                b->p = NULL;
+                continue;
+            }
+            if (own(owners, t, pool, b, o->id + 1) != 0) {
+                error(name, i, "block overlaps a live one or lies outside the pool");
+                b->p = NULL;
+                continue;
+            }
+            size_t last = ((size_t)PAGE_SIZE << (b->rank - 1)) / sizeof(uint64_t) - 1;
+            b->p[0] = b->p[last] = stamp(b, o->id);
+        } else if (b->p != NULL) {
+            size_t last = ((size_t)PAGE_SIZE << (b->rank - 1)) / sizeof(uint64_t) - 1;
+            if (b->p[0] != stamp(b, o->id) || b->p[last] != stamp(b, o->id))
+                error(name, i, "block overwritten");
+            own(owners, t, pool, b, 0);
+            if (return_pages(b->p) != OK) error(name, i, "return_pages failed");
+            b->p = NULL;
+        }
+        double frag = fragmentation(maxrank);
+        if (frag > peak) peak = frag;
+    }
+
+    // Timed pass.
+    memset(live, 0, sizeof(struct live) * t->ids);
+    init_page(pool, t->pages);
+    double start = now();
+    for (int i = 0; i < t->nops; i++) {
+        struct op *o = &t->ops[i];
+        if (o->type == 'a') {
+            live[o->id].p = alloc_pages(o->rank);
+        } else if (!IS_ERR(live[o->id].p) && live[o->id].p != NULL) {
+            return_pages(live[o->id].p);
+        }
+    }
+    double secs = now() - start;
+    free(owners);
+    printf("%-24s %10d %14.0f %10d %9.1f%%\n", name, t->nops, t->nops / secs, failures, peak);
+    free(live);
+    unmap_pool(pool, t->pages, POOL_SMALL);
+}
+
+void usage() {
+    printf("usage: replay [-p pages] file...\n"
+           "       replay -g uniform|zipf [-w] [-p pages] [-n allocs] [-r maxrank] "
+           "[-l long%%] [-s seed]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int pages = 0, allocs = DEFAULT_ALLOCS, maxrank = DEFAULT_MAXRANK, long_pct = 0, write = 0;
+    unsigned seed = 1;
+    const char *gen = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "g:wp:n:r:l:s:")) != -1) {
+        switch (c) {
+            case 'g': gen = optarg; break;
+            case 'w': write = 1; break;
+            case 'p': pages = atoi(optarg); break;
+            case 'n': allocs = atoi(optarg); break;
+            case 'r': maxrank = atoi(optarg); break;
+            case 'l': long_pct = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    struct trace t;
+    if (gen != NULL) {
+        if ((strcmp(gen, "uniform") != 0 && strcmp(gen, "zipf") != 0) || allocs <= 0 ||
+            maxrank < 1 || maxrank > MAX_RANK || long_pct < 0 || long_pct > 100)
+            usage();
+        generate(&t, strcmp(gen, "zipf") == 0, allocs, maxrank, long_pct, seed,
+                 pages > 0 ? pages : DEFAULT_PAGES);
+        if (write) {
+            write_trace(stdout, &t);
+        } else {
+            char name[64];
+            snprintf(name, sizeof(name), "%s/%d%%long", gen, long_pct);
+            printf("%-24s %10s %14s %10s %10s\n", "trace", "ops", "ops/s", "failures", "peak frag");
+            replay(name, &t);
+        }
+        free(t.ops);
+        return errors ? -1 : 0;
+    }
+    if (optind == argc) usage();
+    printf("%-24s %10s %14s %10s %10s\n", "trace", "ops", "ops/s", "failures", "peak frag");
+    for (int i = optind; i < argc; i++) {
+        FILE *f = fopen(argv[i], "r");
+        t.ops = NULL;
+        if (f == NULL) printf("[x] %s: cannot open trace\n", argv[i]);
+        if (f == NULL || read_trace(f, argv[i], &t) != 0) {
+            errors++;
+            if (f != NULL) fclose(f);
+            free(t.ops);
+            continue;
+        }
+        fclose(f);
+        if (pages > 0) t.pages = pages;
+        replay(argv[i], &t);
+        free(t.ops);
+    }
+    return errors ? -1 : 0;
+}
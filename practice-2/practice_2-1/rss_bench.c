@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "buddy.h"
+
+// A traffic spike: touch every page of a 256 MiB pool through rank-1
+// allocations, free them all, and look at the RSS that is left, without
+// scavenging and with MADV_DONTNEED or MADV_FREE. MADV_FREE pages only
+// leave the RSS under memory pressure, so for it the released count is
+// what matters.
+
+#define POOLPAGES (65536)
+
+void *pages[POOLPAGES];
+
+long rss_kb() {
+    long size, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL || fscanf(f, "%ld %ld", &size, &resident) != 2) resident = -1;
+    if (f != NULL) fclose(f);
+    return resident * (PAGE_SIZE / 1024);
+}
+
+void run(const char *name, int rank, int advice) {
+    struct timespec start, stop;
+    void *pool = map_pool(POOLPAGES, POOL_SMALL);
+    init_page(pool, POOLPAGES);
+    buddy_scavenge_setup(rank, POOLPAGES / 16, advice);
+    long base = rss_kb();
+    for (int i = 0; i < POOLPAGES; ++i) {
+        pages[i] = alloc_pages(1);
+        memset(pages[i], 1, PAGE_SIZE);
+    }
+    long peak = rss_kb();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < POOLPAGES; ++i) return_pages(pages[i]);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    long after = rss_kb();
+    double ms = (stop.tv_sec - start.tv_sec) * 1e3 + (stop.tv_nsec - start.tv_nsec) / 1e6;
+    printf("%-10s %10ld %10ld %10ld %12ld %10.2f\n", name, base, peak, after,
+           query_released_pages() * (PAGE_SIZE / 1024), ms);
+    buddy_scavenge_setup(0, 0, MADV_FREE);
+    unmap_pool(pool, POOLPAGES, POOL_SMALL);
+}
+
+int main() {
+    printf("%-10s %10s %10s %10s %12s %10s\n", "scavenge", "base (kB)", "peak (kB)", "after (kB)",
+           "released kB", "free (ms)");
+    run("off", 0, MADV_FREE);
+    run("DONTNEED", 10, MADV_DONTNEED);
+    run("FREE", 10, MADV_FREE);
+    return 0;
+}
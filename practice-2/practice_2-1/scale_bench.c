@@ -0,0 +1,228 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "perf.h"
+
+// Scalability of alloc_pages()/return_pages() from 1..N threads, with
+// the per-rank locks alone and with the per-CPU page caches in front.
+// Every thread draws ranks uniformly or with P(r) ~ 1/r, and keeps each
+// block for a while: a block is short-lived (returned `short` allocations
+// later) or, with probability long%, long-lived (returned `long`
+// allocations later). Reported per run: throughput, latency percentiles
+// of one in SAMPLE calls, and L1D / last-level cache misses per call,
+// counted in every thread with perf_event_open() (n/a where perf is not
+// available).
+
+#define DEFAULT_OPS 200000    // allocations per thread
+#define DEFAULT_MAXRANK 4
+#define DEFAULT_SHORT 16
+#define DEFAULT_LONG 1024
+#define SAMPLE 8
+#define PCP_LOW 32
+#define PCP_HIGH 64
+
+#define PERF_L1D_MISS                                                  \
+    (PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |   \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+struct worker {
+    pthread_t tid;
+    unsigned seed;
+    uint32_t *lat;    // sampled latencies, in ns
+    long nlat, fails;
+    long long l1d, llc;
+};
+
+static int ops, maxrank, short_life, long_life, long_pct;
+static double cdf[MAX_RANK], cdf_sum;
+static pthread_barrier_t barrier;
+
+static inline long nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int draw_rank(unsigned *seed) {
+    double x = (double)rand_r(seed) / ((double)RAND_MAX + 1) * cdf_sum;
+    int rank = 1;
+    while (rank < maxrank && x >= cdf[rank - 1]) rank++;
+    return rank;
+}
+
+// One call, timed if it is a sampled one.
+static inline void *timed_alloc(struct worker *w, int rank, long i) {
+    if (i % SAMPLE != 0) return alloc_pages(rank);
+    long t = nsec();
+    void *p = alloc_pages(rank);
+    w->lat[w->nlat++] = nsec() - t;
+    return p;
+}
+
+static inline void timed_return(struct worker *w, void *p, long i) {
+    if (i % SAMPLE != 0) {
+        return_pages(p);
+        return;
+    }
+    long t = nsec();
+    return_pages(p);
+    w->lat[w->nlat++] = nsec() - t;
+}
+
+// Each lifetime is a ring of slots: the allocation that lands in a slot
+// returns the block allocated there one lap earlier.
+static void *worker(void *arg) {
+    struct worker *w = arg;
+    void **ring[2];
+    int size[2] = {short_life, long_life}, pos[2] = {0, 0};
+    ring[0] = calloc(short_life, sizeof(void *));
+    ring[1] = calloc(long_life, sizeof(void *));
+    int l1d = perf_open(PERF_TYPE_HW_CACHE, PERF_L1D_MISS);
+    int llc = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    pthread_barrier_wait(&barrier);
+    perf_start(l1d);
+    perf_start(llc);
+    long call = 0;
+    for (int i = 0; i < ops; i++) {
+        int life = rand_r(&w->seed) % 100 < long_pct;
+        void **slot = &ring[life][pos[life]];
+        pos[life] = (pos[life] + 1) % size[life];
+        if (*slot != NULL) timed_return(w, *slot, call++);
+        *slot = timed_alloc(w, draw_rank(&w->seed), call++);
+        if (IS_ERR(*slot)) {
+            w->fails++;
+            *slot = NULL;
+        }
+    }
+    w->l1d = perf_stop(l1d);
+    w->llc = perf_stop(llc);
+    perf_close(l1d);
+    perf_close(llc);
+    for (int life = 0; life < 2; life++) {
+        for (int j = 0; j < size[life]; j++) {
+            if (ring[life][j] != NULL) return_pages(ring[life][j]);
+        }
+        free(ring[life]);
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(const char *mode, int nthread) {
+    struct worker w[nthread];
+    long max_lat = 2L * ops / SAMPLE + 2;
+    uint32_t *lat = malloc(sizeof(uint32_t) * max_lat * nthread);
+    pthread_barrier_init(&barrier, NULL, nthread + 1);
+    for (int i = 0; i < nthread; i++) {
+        w[i] = (struct worker){.seed = i + 1, .lat = lat + max_lat * i};
+        pthread_create(&w[i].tid, NULL, worker, &w[i]);
+    }
+    pthread_barrier_wait(&barrier);
+    long start = nsec();
+    for (int i = 0; i < nthread; i++) pthread_join(w[i].tid, NULL);
+    double secs = (nsec() - start) / 1e9;
+    pthread_barrier_destroy(&barrier);
+
+    // Gather the samples and the counters.
+    long n = 0, fails = 0;
+    long long l1d = 0, llc = 0;
+    for (int i = 0; i < nthread; i++) {
+        memmove(lat + n, w[i].lat, sizeof(uint32_t) * w[i].nlat);
+        n += w[i].nlat;
+        fails += w[i].fails;
+        l1d = l1d < 0 || w[i].l1d < 0 ? -1 : l1d + w[i].l1d;
+        llc = llc < 0 || w[i].llc < 0 ? -1 : llc + w[i].llc;
+    }
+    qsort(lat, n, sizeof(uint32_t), cmp_u32);
+    double calls = 2.0 * ops * nthread;
+    char l1d_str[16] = "n/a", llc_str[16] = "n/a";
+    if (l1d >= 0) snprintf(l1d_str, sizeof(l1d_str), "%.2f", l1d / calls);
+    if (llc >= 0) snprintf(llc_str, sizeof(llc_str), "%.2f", llc / calls);
+    printf("%-8d %-6s %12.0f %7u %7u %7u %7u %9s %9s %8ld\n", nthread, mode, calls / secs,
+           lat[n / 2], lat[n * 90 / 100], lat[n * 99 / 100], lat[n * 999 / 1000], l1d_str, llc_str,
+           fails);
+    free(lat);
+}
+
+static void usage() {
+    printf("usage: scale_bench [-t threads] [-n allocs] [-d uniform|zipf] [-r maxrank]\n"
+           "                   [-s short] [-L long] [-l long%%]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int max_thread = sysconf(_SC_NPROCESSORS_ONLN), zipf = 1;
+    ops = DEFAULT_OPS;
+    maxrank = DEFAULT_MAXRANK;
+    short_life = DEFAULT_SHORT;
+    long_life = DEFAULT_LONG;
+    long_pct = 10;
+    int c;
+    while ((c = getopt(argc, argv, "t:n:d:r:s:L:l:")) != -1) {
+        switch (c) {
+            case 't': max_thread = atoi(optarg); break;
+            case 'n': ops = atoi(optarg); break;
+            case 'd':
+                if (strcmp(optarg, "uniform") != 0 && strcmp(optarg, "zipf") != 0) usage();
+                zipf = strcmp(optarg, "zipf") == 0;
+                break;
+            case 'r': maxrank = atoi(optarg); break;
+            case 's': short_life = atoi(optarg); break;
+            case 'L': long_life = atoi(optarg); break;
+            case 'l': long_pct = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (max_thread < 1 || ops < 1 || maxrank < 1 || maxrank > MAX_RANK || short_life < 1 ||
+        long_life < 1 || long_pct < 0 || long_pct > 100)
+        usage();
+    for (int r = 1; r <= maxrank; r++) cdf[r - 1] = cdf_sum += zipf ? 1.0 / r : 1.0;
+
+    // Room for every thread to hold a full set of the largest blocks.
+    long pages = (long)max_thread * (short_life + long_life) << (maxrank - 1);
+    if (pages > (1L << 30) / PAGE_SIZE * 16) {
+        printf("[x] %ld pages do not fit\n", pages);
+        return -1;
+    }
+    void *p = map_pool(pages, POOL_SMALL);
+    if (IS_ERR(p)) {
+        printf("[x] cannot map %ld pages\n", pages);
+        return -1;
+    }
+    init_page(p, pages);
+    long free_pages = 0;
+    for (int r = 1; r <= MAX_RANK; r++) free_pages += (long)query_page_counts(r) << (r - 1);
+
+    printf("%s ranks 1..%d, lifetime %d/%d allocations (%d%% long), %d allocations per thread, "
+           "latencies in ns\n",
+           zipf ? "zipf" : "uniform", maxrank, short_life, long_life, long_pct, ops);
+    printf("%-8s %-6s %12s %7s %7s %7s %7s %9s %9s %8s\n", "threads", "mode", "ops/s", "p50",
+           "p90", "p99", "p99.9", "L1D/op", "LLC/op", "failures");
+    // Powers of two, and the full thread count last even if it is not one.
+    for (int n = 1; n <= max_thread;
+         n = n * 2 > max_thread && n != max_thread ? max_thread : n * 2) {
+        buddy_pcp_setup(0, 0);
+        run("locks", n);
+        buddy_pcp_setup(PCP_LOW, PCP_HIGH);
+        run("pcp", n);
+    }
+    buddy_pcp_setup(0, 0);
+    long left = 0;
+    for (int r = 1; r <= MAX_RANK; r++) left += (long)query_page_counts(r) << (r - 1);
+    if (left != free_pages) {
+        printf("[x] pages leaked\n");
+        return -1;
+    }
+    unmap_pool(p, pages, POOL_SMALL);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "utils.h"
+int fake_mode = 0;
+int cont = 0;
+
+// Giving free blocks back to the OS, and the released page count.
+
+#define MAXRANK (16)
+#define PGCOUNT (32768)
+int tCnt = 0;
+
+int main() {
+    void *p, *q, *r;
+
+    printf("Scavenger test suite: \n");
+    p = map_pool(PGCOUNT, POOL_SMALL);
+    {
+        printf("Phase 1: release and split\n");
+        ok(init_page(p, PGCOUNT) == OK);
+        ok(buddy_scavenge_setup(1, 0, MADV_FREE) == -EINVAL);
+        ok(buddy_scavenge_setup(10, 0, MADV_NORMAL) == -EINVAL);
+        ok(buddy_scavenge_setup(10, 0, MADV_DONTNEED) == OK);
+        ok(query_released_pages() == 0);
+        ok(buddy_scavenge() == PGCOUNT - 1);
+        ok(query_released_pages() == PGCOUNT - 1);
+        ok(buddy_scavenge() == 0);
+        // The halves split off stay released but for their first page.
+        q = alloc_pages(1);
+        ok(q == p);
+        ok(query_released_pages() == PGCOUNT - MAXRANK);
+        // Freeing merges the pool back and releases it again.
+        ok(return_pages(q) == OK);
+        ok(query_released_pages() == PGCOUNT - 1);
+    }
+    {
+        printf("Phase 2: released pages lose their contents\n");
+        tCnt = 0;
+        r = alloc_pages(10);
+        memset(r, 0xab, 512 * PAGE_SIZE);
+        ok(return_pages(r) == OK);
+        r = alloc_pages(10);
+        ok(r == p);
+        ok(((unsigned char *)r)[5 * PAGE_SIZE] == 0);
+        ok(((unsigned char *)r)[511 * PAGE_SIZE] == 0);
+        ok(return_pages(r) == OK);
+    }
+    {
+        printf("Phase 3: resident free pages below the threshold are kept\n");
+        tCnt = 0;
+        ok(init_page(p, PGCOUNT) == OK);
+        ok(buddy_scavenge_setup(10, PGCOUNT, MADV_FREE) == OK);
+        r = alloc_pages(10);
+        ok(return_pages(r) == OK);
+        ok(query_released_pages() == 0);
+        ok(buddy_scavenge_setup(10, PGCOUNT / 2, MADV_FREE) == OK);
+        r = alloc_pages(10);
+        ok(return_pages(r) == OK);
+        ok(query_released_pages() == PGCOUNT - 1);
+        ok(buddy_scavenge_setup(0, 0, MADV_FREE) == OK);
+        ok(init_page(p, PGCOUNT) == OK);
+        ok(buddy_scavenge() == 0);
+    }
+    unmap_pool(p, PGCOUNT, POOL_SMALL);
+    finish();
+
+    return 0;
+}
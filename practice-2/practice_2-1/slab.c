@@ -0,0 +1,173 @@
+#include "slab.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "spinlock.h"
+
+// At the start of every slab. bitmap has one bit per object, set iff the
+// object is free.
+struct slab {
+  struct slab *next;
+  struct slab *prev;
+  struct slab **list;  // the list of the cache it is on
+  struct kmem_cache *cache;
+  uint8_t *first;  // object 0
+  int inuse;
+  uint64_t bitmap[];
+};
+
+static void list_add(struct slab **list, struct slab *s) {
+  s->list = list;
+  s->prev = NULL;
+  s->next = *list;
+  if (*list != NULL) (*list)->prev = s;
+  *list = s;
+}
+
+static void list_del(struct slab *s) {
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    *s->list = s->next;
+  }
+  if (s->next != NULL) s->next->prev = s->prev;
+}
+
+static void list_move(struct slab **list, struct slab *s) {
+  list_del(s);
+  list_add(list, s);
+}
+
+static inline size_t bitmap_words(int objs) { return (objs + 63) / 64; }
+
+struct kmem_cache *kmem_cache_create(size_t size, size_t align) {
+  if (size == 0 || (align & (align - 1)) != 0) return ERR_PTR(-EINVAL);
+  if (align < 8) align = 8;
+  size_t stride = (size + align - 1) & ~(align - 1);
+  // The smallest slab that holds KMEM_MIN_OBJS objects after its header.
+  // Pools need not be aligned, so leave room to align object 0.
+  int rank = 1, objs = 0;
+  size_t header = 0;
+  for (; rank <= MAX_RANK; rank++) {
+    size_t bytes = (size_t)PAGE_SIZE << (rank - 1);
+    for (objs = bytes / stride; objs > 0; objs--) {
+      header = sizeof(struct slab) + bitmap_words(objs) * sizeof(uint64_t);
+      if (header + align - 1 + objs * stride <= bytes) break;
+    }
+    if (objs >= KMEM_MIN_OBJS) break;
+  }
+  if (rank > MAX_RANK) return ERR_PTR(-EINVAL);
+
+  struct kmem_cache *cache = calloc(1, sizeof(struct kmem_cache));
+  if (cache == NULL) return ERR_PTR(-ENOMEM);
+  cache->size = size;
+  cache->align = align;
+  cache->stride = stride;
+  cache->rank = rank;
+  cache->objs = objs;
+  cache->header = header;
+  return cache;
+}
+
+static void free_slabs(struct slab *s) {
+  while (s != NULL) {
+    struct slab *next = s->next;
+    return_pages(s);
+    s = next;
+  }
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache) {
+  if (cache == NULL || IS_ERR(cache)) return;
+  free_slabs(cache->partial);
+  free_slabs(cache->full);
+  free_slabs(cache->empty);
+  free(cache);
+}
+
+static struct slab *new_slab(struct kmem_cache *cache) {
+  struct slab *s = alloc_pages_type(cache->rank, MIGRATE_UNMOVABLE);
+  if (IS_ERR(s)) return NULL;
+  s->cache = cache;
+  s->first = (uint8_t *)(((uintptr_t)s + cache->header + cache->align - 1) & ~(cache->align - 1));
+  s->inuse = 0;
+  size_t words = bitmap_words(cache->objs);
+  for (size_t i = 0; i < words; i++) s->bitmap[i] = ~0ULL;
+  if (cache->objs % 64 != 0) s->bitmap[words - 1] = (1ULL << (cache->objs % 64)) - 1;
+  return s;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+  spin_lock(&cache->lock);
+  struct slab *s = cache->partial;
+  if (s == NULL && cache->empty != NULL) {
+    s = cache->empty;
+    list_move(&cache->partial, s);
+    cache->nr_empty--;
+  }
+  if (s == NULL) {
+    // The buddy allocator has locks of its own; no need to hold ours.
+    spin_unlock(&cache->lock);
+    struct slab *fresh = new_slab(cache);
+    spin_lock(&cache->lock);
+    if (fresh == NULL) {
+      spin_unlock(&cache->lock);
+      return ERR_PTR(-ENOSPC);
+    }
+    list_add(&cache->partial, fresh);
+    cache->nr_slabs++;
+    s = cache->partial;
+  }
+  int i = 0;
+  while (s->bitmap[i] == 0) i++;
+  int idx = i * 64 + __builtin_ctzll(s->bitmap[i]);
+  s->bitmap[i] &= s->bitmap[i] - 1;
+  if (++s->inuse == cache->objs) list_move(&cache->full, s);
+  cache->nr_objs++;
+  spin_unlock(&cache->lock);
+  return s->first + idx * cache->stride;
+}
+
+int kmem_cache_free(struct kmem_cache *cache, void *obj) {
+  struct slab *s = query_block_head(obj);
+  if (IS_ERR(s) || s->cache != cache) return -EINVAL;
+  if ((uint8_t *)obj < s->first || ((uint8_t *)obj - s->first) % cache->stride != 0) return -EINVAL;
+  size_t idx = ((uint8_t *)obj - s->first) / cache->stride;
+  if (idx >= (size_t)cache->objs) return -EINVAL;
+
+  struct slab *release = NULL;
+  spin_lock(&cache->lock);
+  if (s->bitmap[idx / 64] & (1ULL << (idx % 64))) {
+    spin_unlock(&cache->lock);
+    return -EINVAL;
+  }
+  s->bitmap[idx / 64] |= 1ULL << (idx % 64);
+  if (s->inuse-- == cache->objs) list_move(&cache->partial, s);
+  if (s->inuse == 0) {
+    if (cache->nr_empty < KMEM_EMPTY_MAX) {
+      list_move(&cache->empty, s);
+      cache->nr_empty++;
+    } else {
+      list_del(s);
+      cache->nr_slabs--;
+      release = s;
+    }
+  }
+  cache->nr_objs--;
+  spin_unlock(&cache->lock);
+  if (release != NULL) return_pages(release);
+  return OK;
+}
+
+int kmem_cache_shrink(struct kmem_cache *cache) {
+  spin_lock(&cache->lock);
+  struct slab *s = cache->empty;
+  int count = cache->nr_empty;
+  cache->empty = NULL;
+  cache->nr_slabs -= count;
+  cache->nr_empty = 0;
+  spin_unlock(&cache->lock);
+  free_slabs(s);
+  return count;
+}
@@ -0,0 +1,43 @@
+#ifndef OS_SLAB_H
+#define OS_SLAB_H
+#include <stddef.h>
+
+#include "buddy.h"
+
+// Caches of fixed-size objects carved out of alloc_pages() blocks. Each
+// slab is one block with a header and a free bitmap at its start; slabs
+// move between the partial, full and empty lists of their cache, and
+// empty slabs beyond KMEM_EMPTY_MAX go back with return_pages(). Slabs
+// are MIGRATE_UNMOVABLE, so they stay out of the way of compaction.
+
+#define KMEM_MIN_OBJS  8   /* a slab holds at least this many objects */
+#define KMEM_EMPTY_MAX 2   /* empty slabs kept for reuse */
+
+struct slab;
+
+struct kmem_cache {
+  size_t size;    // object size as asked for
+  size_t align;
+  size_t stride;  // distance between objects
+  int rank;       // of a slab
+  int objs;       // per slab
+  size_t header;  // bytes of slab header and bitmap
+  volatile int lock;
+  struct slab *partial, *full, *empty;
+  int nr_slabs, nr_empty;
+  long nr_objs;   // allocated objects
+};
+
+// `align` is 0 or a power of two; objects are at least 8 bytes aligned.
+// Returns ERR_PTR(-EINVAL) or ERR_PTR(-ENOMEM) on failure.
+struct kmem_cache *kmem_cache_create(size_t size, size_t align);
+// Frees every slab; objects still allocated are lost.
+void kmem_cache_destroy(struct kmem_cache *cache);
+// ERR_PTR(-ENOSPC) if no slab can be allocated.
+void *kmem_cache_alloc(struct kmem_cache *cache);
+// -EINVAL if `obj` is not an allocated object of `cache`.
+int kmem_cache_free(struct kmem_cache *cache, void *obj);
+// Return every empty slab; returns how many were returned.
+int kmem_cache_shrink(struct kmem_cache *cache);
+
+#endif
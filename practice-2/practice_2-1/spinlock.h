@@ -0,0 +1,18 @@
+#ifndef OS_SPINLOCK_H
+#define OS_SPINLOCK_H
+#include <sched.h>
+
+// Test-and-test-and-set lock shared by buddy.c and slab.c. A waiter that
+// has spun for a while yields the CPU to the holder.
+
+static inline void spin_lock(volatile int *lock) {
+  for (int spins = 0; __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE); spins++) {
+    while (*lock) {
+      if (++spins > 1000) sched_yield();
+    }
+  }
+}
+
+static inline void spin_unlock(volatile int *lock) { __atomic_store_n(lock, 0, __ATOMIC_RELEASE); }
+
+#endif
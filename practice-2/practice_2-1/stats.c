@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "utils.h"
+int fake_mode = 0;
+int cont = 0;
+
+// Statistics, the event trace and buddy_info(). Built with -DBUDDY_STATS
+// and -DBUDDY_TRACE.
+
+#define MAXRANK (16)
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+#define ZONEPAGES (1024)
+int tCnt = 0;
+
+long latency_total(struct buddy_stats *st) {
+    long n = 0;
+    for (int i = 0; i < BUDDY_LATENCY_BUCKETS; i++) n += st->latency[i];
+    return n;
+}
+
+// The buddy_info() row `name` with a single block of `rank`.
+void info_row(char *row, const char *name, int rank) {
+    int off = sprintf(row, "%-12s", name);
+    for (int r = 1; r <= MAX_RANK; r++) off += sprintf(row + off, " %6d", r == rank);
+    strcpy(row + off, "\n");
+}
+
+int main() {
+    void *p, *q, *r;
+    int pgIdx, n;
+    struct buddy_stats st;
+    static struct buddy_event ev[BUDDY_TRACE_SIZE];
+
+    printf("Statistics test suite: \n");
+    p = malloc(TESTSIZE * 1024 * 1024);
+    {
+        printf("Phase 1: counters\n");
+        ok(init_page(p, PGCOUNT) == OK);
+        buddy_stats_reset();
+        ok(query_buddy_stats(NULL) == -EINVAL);
+        q = alloc_pages(1);
+        ok(q == p);
+        ok(query_buddy_stats(&st) == OK);
+        ok(st.allocs[0] == 1 && st.splits[0] == 0);
+        for (pgIdx = 2; pgIdx <= MAXRANK; pgIdx++) dotOk(st.splits[pgIdx - 1] == 1);
+        dotDone();
+        ok(return_pages(q) == OK);
+        ok(query_buddy_stats(&st) == OK);
+        ok(st.frees[0] == 1 && st.merges[MAXRANK - 1] == 0);
+        for (pgIdx = 1; pgIdx < MAXRANK; pgIdx++) dotOk(st.merges[pgIdx - 1] == 1);
+        dotDone();
+        q = alloc_pages(MAXRANK);
+        ok(PTR_ERR(alloc_pages(1)) == -ENOSPC);
+        ok(PTR_ERR(alloc_pages(MAXRANK + 4)) == -EINVAL);
+        ok(query_buddy_stats(&st) == OK);
+        ok(st.allocs[MAXRANK - 1] == 1 && st.failures[0] == 1);
+        ok(latency_total(&st) == 3);
+        ok(return_pages(q) == OK);
+        buddy_stats_reset();
+        ok(query_buddy_stats(&st) == OK);
+        ok(st.allocs[0] == 0 && st.splits[1] == 0 && latency_total(&st) == 0);
+    }
+    {
+        printf("Phase 2: event trace\n");
+        tCnt = 0;
+        ok(buddy_trace_read(NULL, 1) == -EINVAL);
+        // 15 splits, an allocation, a free, 15 merges, an allocation, a
+        // failure and a free.
+        n = buddy_trace_read(ev, BUDDY_TRACE_SIZE);
+        ok(n == 35);
+        ok(ev[0].seq == 1 && ev[0].type == BUDDY_EV_SPLIT && ev[0].rank == MAXRANK);
+        ok(ev[15].type == BUDDY_EV_ALLOC && ev[15].rank == 1 && ev[15].addr == p);
+        ok(ev[16].type == BUDDY_EV_FREE && ev[17].type == BUDDY_EV_MERGE && ev[17].rank == 1);
+        ok(ev[33].type == BUDDY_EV_FAIL && ev[33].addr == NULL);
+        ok(ev[34].type == BUDDY_EV_FREE && ev[34].rank == MAXRANK);
+        ok(ev[34].nsec >= ev[0].nsec);
+        ok(buddy_trace_read(ev, 2) == 2 && ev[0].seq == 34 && ev[1].seq == 35);
+        // Wrap around the ring.
+        for (pgIdx = 0; pgIdx < BUDDY_TRACE_SIZE; pgIdx++) {
+            r = alloc_pages(MAXRANK);
+            return_pages(r);
+        }
+        n = buddy_trace_read(ev, BUDDY_TRACE_SIZE);
+        ok(n == BUDDY_TRACE_SIZE);
+        ok(ev[n - 1].seq == 35 + 2 * BUDDY_TRACE_SIZE);
+        for (pgIdx = 1; pgIdx < n; pgIdx++) dotOk(ev[pgIdx].seq == ev[pgIdx - 1].seq + 1);
+        dotDone();
+    }
+    {
+        printf("Phase 3: buddyinfo\n");
+        tCnt = 0;
+        char buf[4096], row[256];
+        q = malloc((size_t)ZONEPAGES * PAGE_SIZE);
+        ok(add_zone(q, ZONEPAGES) == OK);
+        n = buddy_info(buf, sizeof(buf));
+        ok(n == (int)strlen(buf));
+        printf("%s", buf);
+        info_row(row, "zone 0", MAXRANK);
+        ok(strstr(buf, row) != NULL);
+        info_row(row, "zone 1", 11);
+        ok(strstr(buf, row) != NULL);
+        info_row(row, "unmovable", 0);
+        ok(strstr(buf, row) != NULL);
+        // The stolen pageblocks stay unmovable, and so does the block
+        // they merge back into.
+        r = alloc_pages_type(11, MIGRATE_UNMOVABLE);
+        ok(r == p);
+        ok(return_pages(r) == OK);
+        ok(buddy_info(buf, sizeof(buf)) == n);
+        info_row(row, "unmovable", MAXRANK);
+        ok(strstr(buf, row) != NULL);
+        info_row(row, "movable", 11);
+        ok(strstr(buf, row) != NULL);
+        // A short buffer gets what fits, and the full length is returned.
+        ok(buddy_info(row, 10) == n && strlen(row) == 9);
+        ok(buddy_info(NULL, 0) == n);
+        free(q);
+    }
+    free(p);
+    finish();
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+// Concurrent alloc/return stress test. Every thread stamps the blocks it
+// owns and checks the stamp before giving them back, which catches a
+// block handed out twice. Between rounds all threads stop at a barrier
+// and the main thread checks that free + live pages add up, using
+// query_page_counts and query_ranks. The last run turns scavenging on and
+// off while the workers run. The threads never hold more than half of the
+// pool, so at most half of the aligned blocks of ALLOC_RANK_MAX are in
+// use and every allocation must succeed, even while other threads have
+// blocks off the lists to split or merge them.
+
+#define MAXRANK (16)
+#define TESTSIZE (128)
+#define PGCOUNT (TESTSIZE * 1024 / 4)
+#define NTHREAD 8
+#define LIVE_MAX 64
+#define ALLOC_RANK_MAX 6
+#define DEFAULT_ROUNDS 50
+#define OPS_PER_ROUND 2000
+#define SCAVENGE_RANK 4
+
+struct block {
+    uint64_t *p;
+    int rank;
+};
+
+struct worker {
+    int id;
+    unsigned seed;
+    struct block live[LIVE_MAX];
+    int nlive;
+} workers[NTHREAD];
+
+pthread_barrier_t round_start, round_end;
+int rounds;
+int failed;
+
+void check(int cond, const char *what, int id) {
+    if (!cond) {
+        printf("[x] thread %d: %s\n", id, what);
+        failed = 1;
+    }
+}
+
+uint64_t stamp(struct worker *w, struct block *b) {
+    return ((uint64_t)w->id << 56) ^ (uintptr_t)b->p ^ b->rank;
+}
+
+void release(struct worker *w, int i) {
+    struct block *b = &w->live[i];
+    size_t last = ((size_t)PAGE_SIZE << (b->rank - 1)) / sizeof(uint64_t) - 1;
+    check(b->p[0] == stamp(w, b) && b->p[last] == stamp(w, b), "block overwritten", w->id);
+    check(return_pages(b->p) == OK, "return_pages failed", w->id);
+    w->live[i] = w->live[--w->nlive];
+}
+
+void *worker_main(void *arg) {
+    struct worker *w = arg;
+    for (int round = 0; round < rounds; ++round) {
+        pthread_barrier_wait(&round_start);
+        for (int op = 0; op < OPS_PER_ROUND; ++op) {
+            if (w->nlive == LIVE_MAX || (w->nlive > 0 && rand_r(&w->seed) % 2 == 0)) {
+                release(w, rand_r(&w->seed) % w->nlive);
+                continue;
+            }
+            struct block *b = &w->live[w->nlive];
+            b->rank = 1 + rand_r(&w->seed) % ALLOC_RANK_MAX;
+            b->p = alloc_pages(b->rank);
+            if (IS_ERR(b->p)) {
+                check(0, PTR_ERR(b->p) == -ENOSPC ? "alloc failed below capacity"
+                                                  : "unexpected alloc error", w->id);
+                continue;
+            }
+            size_t last = ((size_t)PAGE_SIZE << (b->rank - 1)) / sizeof(uint64_t) - 1;
+            b->p[0] = b->p[last] = stamp(w, b);
+            w->nlive++;
+        }
+        pthread_barrier_wait(&round_end);
+    }
+    while (w->nlive > 0) release(w, w->nlive - 1);
+    return NULL;
+}
+
+// Called while every worker waits at the barrier.
+void check_invariants(int round) {
+    long free_pages = 0, live_pages = 0;
+    buddy_pcp_drain();
+    for (int rank = 1; rank <= MAXRANK; ++rank) {
+        free_pages += (long)query_page_counts(rank) << (rank - 1);
+    }
+    for (int t = 0; t < NTHREAD; ++t) {
+        for (int i = 0; i < workers[t].nlive; ++i) {
+            struct block *b = &workers[t].live[i];
+            live_pages += 1L << (b->rank - 1);
+            check(query_ranks(b->p) == b->rank, "query_ranks mismatch", t);
+        }
+    }
+    if (free_pages + live_pages != PGCOUNT) {
+        printf("[x] round %d: %ld free + %ld live != %d pages\n", round, free_pages, live_pages,
+               PGCOUNT);
+        failed = 1;
+    }
+}
+
+void run(const char *name, int scavenge) {
+    pthread_t pid[NTHREAD];
+    for (int t = 0; t < NTHREAD; ++t) {
+        workers[t].id = t;
+        workers[t].seed = t * 7919 + 1;
+        workers[t].nlive = 0;
+        pthread_create(&pid[t], NULL, worker_main, &workers[t]);
+    }
+    for (int round = 0; round < rounds; ++round) {
+        pthread_barrier_wait(&round_start);
+        // Turn scavenging on and off while the workers free blocks.
+        if (scavenge) buddy_scavenge_setup(round % 2 ? 0 : SCAVENGE_RANK, 0, MADV_DONTNEED);
+        pthread_barrier_wait(&round_end);
+        check_invariants(round);
+    }
+    for (int t = 0; t < NTHREAD; ++t) {
+        pthread_join(pid[t], NULL);
+    }
+    buddy_pcp_drain();
+    buddy_coalesce();
+    for (int rank = 1; rank < MAXRANK; ++rank) {
+        check(query_page_counts(rank) == 0, "pool not fully merged", -1);
+    }
+    check(query_page_counts(MAXRANK) == 1, "pool not fully merged", -1);
+    printf("%s: %d rounds x %d threads x %d ops %s\n", name, rounds, NTHREAD, OPS_PER_ROUND,
+           failed ? "FAILED" : "Ok");
+}
+
+int main(int argc, char *argv[]) {
+    rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+    void *p = map_pool(PGCOUNT, POOL_SMALL);
+    init_page(p, PGCOUNT);
+    pthread_barrier_init(&round_start, NULL, NTHREAD + 1);
+    pthread_barrier_init(&round_end, NULL, NTHREAD + 1);
+
+    run("per-rank locks", 0);
+    buddy_pcp_setup(8, 32);
+    run("per-rank locks + pcp", 0);
+    buddy_pcp_setup(0, 0);
+    buddy_lazy_setup(4, 256);
+    run("per-rank locks + lazy", 0);
+    buddy_lazy_setup(0, 0);
+    run("per-rank locks + scavenge", 1);
+    buddy_scavenge_setup(0, 0, MADV_DONTNEED);
+
+    pthread_barrier_destroy(&round_start);
+    pthread_barrier_destroy(&round_end);
+    unmap_pool(p, PGCOUNT, POOL_SMALL);
+    return failed ? -1 : 0;
+}
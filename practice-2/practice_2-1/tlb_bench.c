@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buddy.h"
+#include "perf.h"
+
+// Random reads over rank-10 (2 MiB) buffers allocated from a pool on
+// 4 KiB pages and from a huge page backed pool, counting dTLB misses.
+
+#define POOLPAGES (65536)  // 256 MiB
+#define NBUF 96
+#define BIGRANK 10
+#define DEFAULT_READS 20000000
+
+long anon_huge_kb() {
+    char line[256];
+    long kb = -1;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+void run(const char *name, int huge, long reads) {
+    void *pool = map_pool(POOLPAGES, huge);
+    if (IS_ERR(pool)) {
+        printf("%-8s map_pool failed\n", name);
+        return;
+    }
+    init_page(pool, POOLPAGES);
+    uint64_t *buf[NBUF];
+    size_t words = ((size_t)PAGE_SIZE << (BIGRANK - 1)) / sizeof(uint64_t);
+    for (int i = 0; i < NBUF; ++i) {
+        buf[i] = alloc_pages(BIGRANK);
+        for (size_t j = 0; j < words; ++j) buf[i][j] = j;
+    }
+    long huge_kb = anon_huge_kb();
+
+    int fd = perf_open(PERF_TYPE_HW_CACHE, PERF_DTLB_MISS);
+    uint64_t x = 88172645463325252ULL, sum = 0;
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    perf_start(fd);
+    for (long i = 0; i < reads; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        sum += buf[(x >> 32) % NBUF][x % words];
+    }
+    long long misses = perf_stop(fd);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    perf_close(fd);
+    double secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (misses < 0) {
+        printf("%-8s %12s %10.2f %12ld   (sum %lu)\n", name, "n/a", secs * 1e9 / reads, huge_kb,
+               (unsigned long)sum);
+    } else {
+        printf("%-8s %12lld %10.2f %12ld   (sum %lu)\n", name, misses, secs * 1e9 / reads, huge_kb,
+               (unsigned long)sum);
+    }
+    for (int i = 0; i < NBUF; ++i) return_pages(buf[i]);
+    unmap_pool(pool, POOLPAGES, huge);
+}
+
+int main(int argc, char *argv[]) {
+    long reads = argc > 1 ? atol(argv[1]) : DEFAULT_READS;
+    printf("%-8s %12s %10s %12s\n", "pages", "dTLB misses", "ns/read", "THP (kB)");
+    run("4K", POOL_SMALL, reads);
+    run("2M", POOL_HUGE_2M, reads);
+    return 0;
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "utils.h"
+int fake_mode = 0;
+int cont = 0;
+
+// Pools that are not a power of two pages, several zones, 1 GiB blocks,
+// and huge page aligned pools.
+
+#define MAXRANK (19)
+#define ODDPAGES (16384 + 8192 + 4 + 1)
+#define ZONEPAGES (1024)
+#define BIGPAGES (3 * 262144)  // 3 GiB
+int tCnt = 0;
+void *blocks[ODDPAGES + ZONEPAGES + 1];
+
+int main() {
+    void *p, *q, *r;
+    int ret, pgIdx;
+
+    printf("Zone test suite: \n");
+    {
+        printf("Phase 1: odd page count\n");
+        p = malloc((size_t)ODDPAGES * PAGE_SIZE);
+        ret = init_page(p, ODDPAGES);
+        ok(ret == OK);
+        ok(query_page_counts(15) == 1);
+        ok(query_page_counts(14) == 1);
+        ok(query_page_counts(3) == 1);
+        ok(query_page_counts(1) == 1);
+        ok(query_ranks(p) == 15);
+        ok(query_ranks(p + (size_t)(16384 + 8192) * PAGE_SIZE) == 3);
+    }
+    {
+        printf("Phase 2: every page of the odd pool is usable\n");
+        tCnt = 0;
+        for (pgIdx = 0; pgIdx < ODDPAGES; pgIdx++) {
+            r = alloc_pages(1);
+            dotOk(!IS_ERR(r));
+        }
+        dotDone();
+        r = alloc_pages(1);
+        ok(PTR_ERR(r) == -ENOSPC);
+        q = p;
+        for (pgIdx = 0; pgIdx < ODDPAGES; pgIdx++, q = q + PAGE_SIZE) {
+            dotOk(return_pages(q) == OK);
+        }
+        dotDone();
+        ok(query_page_counts(15) == 1);
+        ok(query_page_counts(14) == 1);
+        ok(query_page_counts(3) == 1);
+        ok(query_page_counts(1) == 1);
+        ok(query_page_counts(2) == 0);
+    }
+    {
+        printf("Phase 3: second zone\n");
+        tCnt = 0;
+        q = malloc((size_t)ZONEPAGES * PAGE_SIZE);
+        ok(add_zone(p + PAGE_SIZE, 1) == -EINVAL);
+        ok(add_zone(q, ZONEPAGES) == OK);
+        ok(query_page_counts(11) == 1);
+        r = alloc_pages(15);
+        ok(r == p);
+        r = alloc_pages(14);
+        ok(!IS_ERR(r));
+        r = alloc_pages(11);
+        ok(r == q);
+        ok(query_ranks(q) == 11);
+        ok(PTR_ERR(alloc_pages(11)) == -ENOSPC);
+        ok(return_pages(r) == OK);
+        ok(query_page_counts(11) == 1);
+        ok(return_pages(q + (size_t)ZONEPAGES * PAGE_SIZE) == -EINVAL);
+        free(q);
+        free(p);
+    }
+    {
+        printf("Phase 4: 1 GiB blocks in a 3 GiB pool\n");
+        tCnt = 0;
+        // Only the first page of each free block is ever touched.
+        p = mmap(NULL, (size_t)BIGPAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        ok(p != MAP_FAILED);
+        ok(init_page(p, BIGPAGES) == OK);
+        ok(query_page_counts(MAXRANK) == 3);
+        for (pgIdx = 0; pgIdx < 3; pgIdx++) {
+            r = alloc_pages(MAXRANK);
+            ok(r == p + (size_t)pgIdx * 262144 * PAGE_SIZE);
+        }
+        ok(PTR_ERR(alloc_pages(1)) == -ENOSPC);
+        ok(PTR_ERR(alloc_pages(MAXRANK + 1)) == -EINVAL);
+        ok(return_pages(p) == OK);
+        r = alloc_pages(1);
+        ok(r == p);
+        ok(query_page_counts(MAXRANK - 1) == 1);
+        ok(return_pages(r) == OK);
+        ok(query_page_counts(MAXRANK) == 1);
+        munmap(p, (size_t)BIGPAGES * PAGE_SIZE);
+    }
+    {
+        printf("Phase 5: query_ranks on every page\n");
+        tCnt = 0;
+        p = malloc((size_t)32768 * PAGE_SIZE);
+        ok(init_page(p, 32768) == OK);
+        q = alloc_pages(3);  // pages 0..3; 4..7, 8..15, ... stay free
+        r = alloc_pages(1);  // page 4
+        ok(q == p && r == p + 4 * PAGE_SIZE);
+        ok(query_ranks(q + 2 * PAGE_SIZE) == 3);
+        ok(query_ranks(p + 5 * PAGE_SIZE) == 1);
+        ok(query_ranks(p + 6 * PAGE_SIZE) == 2);
+        ok(query_ranks(p + 8 * PAGE_SIZE) == 4);
+        ok(query_ranks(p + 12 * PAGE_SIZE) == 3);
+        ok(query_ranks(p + 16384 * PAGE_SIZE) == 15);
+        ok(query_ranks(p + 16385 * PAGE_SIZE) == 1);
+        ok(query_ranks(p + 24576 * PAGE_SIZE) == 14);
+        for (pgIdx = 5; pgIdx < 32768; pgIdx++) {
+            // A free page answers the largest free block starting at it.
+            int align = __builtin_ctz(pgIdx) + 1;
+            dotOk(query_ranks(p + (size_t)pgIdx * PAGE_SIZE) == (align < 15 ? align : 15));
+        }
+        dotDone();
+        ok(return_pages(r) == OK);
+        ok(return_pages(q) == OK);
+        ok(query_ranks(p + 2 * PAGE_SIZE) == 2);
+        ok(query_ranks(p) == 16);
+        free(p);
+    }
+    {
+        printf("Phase 6: bulk alloc and return across zones\n");
+        tCnt = 0;
+        p = malloc((size_t)ODDPAGES * PAGE_SIZE);
+        q = malloc((size_t)ZONEPAGES * PAGE_SIZE);
+        ok(init_page(p, ODDPAGES) == OK);
+        ok(add_zone(q, ZONEPAGES) == OK);
+        ok(alloc_pages_bulk(1, ODDPAGES + ZONEPAGES + 1, blocks) == ODDPAGES + ZONEPAGES);
+        ok(PTR_ERR(alloc_pages(1)) == -ENOSPC);
+        ok(query_ranks(blocks[0]) == 1);
+        // Hand them back in reverse order, with a bogus entry and a
+        // duplicate in the middle.
+        for (pgIdx = 0; pgIdx < (ODDPAGES + ZONEPAGES) / 2; pgIdx++) {
+            r = blocks[pgIdx];
+            blocks[pgIdx] = blocks[ODDPAGES + ZONEPAGES - 1 - pgIdx];
+            blocks[ODDPAGES + ZONEPAGES - 1 - pgIdx] = r;
+        }
+        blocks[ODDPAGES + ZONEPAGES] = p + PAGE_SIZE / 2;
+        ok(return_pages_bulk(blocks, ODDPAGES + ZONEPAGES + 1) == -EINVAL);
+        blocks[0] = p;
+        ok(return_pages_bulk(blocks, 1) == -EINVAL);
+        ok(query_page_counts(15) == 1);
+        ok(query_page_counts(14) == 1);
+        ok(query_page_counts(11) == 1);
+        ok(query_page_counts(3) == 1);
+        ok(query_page_counts(1) == 1);
+        ok(alloc_pages_bulk(3, 5, blocks) == 5);
+        ok(query_ranks(blocks[4]) == 3);
+        ok(return_pages_bulk(blocks, 5) == OK);
+        ok(query_page_counts(3) == 1);
+        ok(alloc_pages_bulk(0, 1, blocks) == -EINVAL);
+        free(q);
+        free(p);
+    }
+    {
+        printf("Phase 7: huge page aligned pools\n");
+        tCnt = 0;
+        p = map_pool(3 * 512 + 7, POOL_HUGE_2M);
+        ok(!IS_ERR(p) && ((unsigned long)p & ((2 << 20) - 1)) == 0);
+        ok(init_page(p, 3 * 512 + 7) == OK);
+        for (pgIdx = 0; pgIdx < 3; pgIdx++) {
+            r = alloc_pages(10);
+            dotOk(!IS_ERR(r) && ((unsigned long)r & ((2 << 20) - 1)) == 0);
+        }
+        dotDone();
+        ok(unmap_pool(p, 3 * 512 + 7, POOL_HUGE_2M) == OK);
+        p = map_pool(1, POOL_SMALL);
+        ok(!IS_ERR(p));
+        ok(unmap_pool(p, 1, POOL_SMALL) == OK);
+        ok(PTR_ERR(map_pool(1, 3)) == -EINVAL);
+    }
+    {
+        printf("Phase 8: largest free block and free histogram\n");
+        tCnt = 0;
+        int hist[MAXRANK];
+        p = malloc((size_t)ODDPAGES * PAGE_SIZE);
+        ok(init_page(p, ODDPAGES) == OK);
+        ok(query_largest_free() == 15);
+        ok(query_free_histogram(NULL) == -EINVAL);
+        ok(query_free_histogram(hist) == OK);
+        for (pgIdx = 1; pgIdx <= MAXRANK; pgIdx++) {
+            dotOk(hist[pgIdx - 1] == query_page_counts(pgIdx));
+        }
+        dotDone();
+        ok(hist[14] == 1 && hist[13] == 1 && hist[2] == 1 && hist[0] == 1);
+        q = alloc_pages(15);
+        r = alloc_pages_type(14, MIGRATE_UNMOVABLE);
+        ok(query_largest_free() == 3);
+        ok(query_free_histogram(hist) == OK && hist[14] == 0 && hist[13] == 0);
+        ok(return_pages(r) == OK);
+        ok(query_largest_free() == 14);
+        alloc_pages_bulk(1, ODDPAGES, blocks);
+        ok(query_largest_free() == 0);
+        free(p);
+    }
+    finish();
+
+    return 0;
+}
@@ -103,6 +103,7 @@ typedef struct {
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
+	double live;     /* sum of live bytes over sum of footprints, after each op */
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -176,7 +177,7 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, double *live);
 static void eval_mm_speed(void *ptr);
 
 /* Various helper routines */
@@ -232,7 +233,7 @@ static void run_tests(int num_tracefiles, char trace_from_stdin,
 		if (mm_stats[i].valid) {
 			if (verbose > 1)
 				printf("efficiency, ");
-			mm_stats[i].util = eval_mm_util(trace, i);
+			mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i].live);
 			speed_params->trace = trace;
 			speed_params->ranges = ranges;
 			if (verbose > 1)
@@ -1057,15 +1058,21 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   doesn't allow the students to decrement the brk pointer, so brk
  *   is always the high water mark of the heap.
  *
+ *   *live is the live bytes summed over every op, divided by
+ *   mem_footprint() summed over every op (both taken after the op). With
+ *   a heap that can give memory back (memlib_buddy.c) the footprint
+ *   follows the live data instead of staying at the peak.
+ *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, double *live)
 {
 	int i;
 	int index;
 	int size, newsize, oldsize;
 	int max_total_size = 0;
 	int total_size = 0;
+	double live_sum = 0, footprint_sum = 0;
 	char *p;
 	char *newp, *oldp;
 
@@ -1136,8 +1143,11 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 		/* update the high-water mark */
 		max_total_size = (total_size > max_total_size) ?
 			total_size : max_total_size;
+		live_sum += total_size;
+		footprint_sum += mem_footprint();
 	}
 
+	*live = footprint_sum > 0 ? live_sum / footprint_sum : 0;
 	printf(".");
 
 	return ((double)max_total_size / (double)mem_heapsize());
@@ -1308,17 +1318,19 @@ static void printresults(int n, stats_t *stats)
 	double sumsecs = 0;
 	double sumops  = 0;
 	double sumutil = 0;
+	double sumlive = 0;
 	int sumweight = 0;
 
 	/* Print the individual results for each trace */
-	printf("  %6s%6s %5s%8s%12s  %s\n",
-			"valid", "util", "ops", "secs", "Kops", "trace");
+	printf("  %6s%6s%6s %5s%8s%12s  %s\n",
+			"valid", "util", "live", "ops", "secs", "Kops", "trace");
 	for (i=0; i < n; i++) {
 		if (stats[i].valid) {
-			printf("%2s%4s %5.0f%%%8.0f%10.6f%9.0f %s\n",
+			printf("%2s%4s %5.0f%%%5.0f%%%8.0f%10.6f%9.0f %s\n",
 					stats[i].weight != 0 ? "*" : "",
 					"yes",
 					stats[i].util*100.0,
+					stats[i].live*100.0,
 					stats[i].ops,
 					stats[i].secs,
 					(stats[i].ops/1e3)/stats[i].secs,
@@ -1327,15 +1339,17 @@ static void printresults(int n, stats_t *stats)
 			sumsecs += stats[i].secs * stats[i].weight;
 			sumops += stats[i].ops * stats[i].weight;
 			sumutil += stats[i].util * stats[i].weight;
+			sumlive += stats[i].live * stats[i].weight;
 		}
 		else {
-			printf("%2s%4s %6s%8s%9s%9s %s\n",
+			printf("%2s%4s %6s%6s%8s%9s%9s %s\n",
 					stats[i].weight != 0 ? "*" : "",
 					"no",
 					"-",
 					"-",
 					"-",
 					"-",
+					"-",
 					stats[i].filename);
 		}
 	}
@@ -1344,15 +1358,17 @@ static void printresults(int n, stats_t *stats)
 	if (errors == 0) {
 		if(sumweight == 0) sumweight = 1;
 
-		printf("%2d     %5.0f%%%8.0f%10.6f%9.0f\n",
+		printf("%2d     %5.0f%%%5.0f%%%8.0f%10.6f%9.0f\n",
 				sumweight,
 				(sumutil/(double)sumweight)*100.0,
+				(sumlive/(double)sumweight)*100.0,
 				sumops,
 				sumsecs,
 				(sumsecs==0.0) ? 0 : (sumops/1e3)/sumsecs);
 	}
 	else {
-		printf("       %8s%10s%6s\n",
+		printf("       %6s%8s%10s%6s\n",
+				"-",
 				"-",
 				"-",
 				"-");
@@ -87,6 +87,14 @@ size_t mem_heapsize() {
 	return (size_t)((void *)mem_brk - (void *)heap);
 }
 
+/*
+ * mem_footprint() - the bytes the heap holds now; the brk never comes
+ *		back down, so that is the heap size
+ */
+size_t mem_footprint() {
+	return mem_heapsize();
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -8,4 +8,9 @@ void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+size_t mem_footprint(void);
+
+/* Page extents, only in memlib_buddy.c */
+void *mem_extent_alloc(size_t size);
+int mem_extent_free(void *p, size_t size);
 
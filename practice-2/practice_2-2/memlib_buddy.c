@@ -0,0 +1,150 @@
+/*
+ * memlib_buddy.c - a memory system model that hands out the heap in
+ *					page extents from the buddy allocator of practice_2-1,
+ *					instead of a single brk that can only grow. Extents
+ *					can be returned, so the footprint follows the live
+ *					data. Built into mdriver-buddy together with mm.c
+ *					compiled with -DMEM_BUDDY.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "memlib.h"
+#include "config.h"
+#include "buddy.h"
+
+#define HEAP_PAGES (MAX_HEAP / PAGE_SIZE)
+
+/* private variables */
+static char *heap;
+static size_t footprint;		/* bytes in live extents */
+static size_t peak_footprint;	/* high water mark of footprint */
+
+/*
+ * mem_init - map the region and hand it to the buddy allocator
+ */
+void mem_init(void){
+	heap = mmap((void *)0x800000000, /* suggested start*/
+			MAX_HEAP,				/* length */
+			PROT_READ | PROT_WRITE,	/* permissions */
+			MAP_PRIVATE | MAP_ANONYMOUS,	/* private or shared? */
+			-1,						/* fd */
+			0);						/* offset */
+	if (heap == MAP_FAILED) {
+		fprintf(stderr, "ERROR: mem_init failed to map the heap\n");
+		exit(1);
+	}
+	mem_reset_brk();
+}
+
+/*
+ * mem_deinit - free the storage used by the memory system model
+ */
+void mem_deinit(void){
+	munmap(heap, MAX_HEAP);
+}
+
+/*
+ * mem_reset_brk - make an empty heap: every extent goes back at once
+ */
+void mem_reset_brk(){
+	init_page(heap, HEAP_PAGES);
+	footprint = 0;
+	peak_footprint = 0;
+}
+
+/*
+ * mem_sbrk - there is no brk in this model; use mem_extent_alloc().
+ */
+void *mem_sbrk(int incr) {
+	(void)incr;
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_sbrk is not available with the buddy heap...\n");
+	return (void *)-1;
+}
+
+/*
+ * mem_extent_alloc - a new extent of at least size bytes, rounded up to
+ *		whole pages and page aligned, or NULL when the heap is full.
+ */
+void *mem_extent_alloc(size_t size) {
+	int npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	void *p = alloc_pages_exact(npages);
+
+	if (IS_ERR(p)) {
+		errno = ENOMEM;
+		fprintf(stderr, "ERROR: mem_extent_alloc failed. Ran out of memory...\n");
+		return NULL;
+	}
+	footprint += (size_t)npages * PAGE_SIZE;
+	if (footprint > peak_footprint)
+		peak_footprint = footprint;
+	return p;
+}
+
+/*
+ * mem_extent_free - return size bytes of extents at p. Extents that were
+ *		allocated back to back can go back as one.
+ */
+int mem_extent_free(void *p, size_t size) {
+	int npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	char *q, *end = (char *)p + (size_t)npages * PAGE_SIZE;
+
+	/* Check that the range is made of allocated blocks before freeing any */
+	for (q = p; q < end; q += (size_t)PAGE_SIZE << (query_ranks(q) - 1)) {
+		if (query_block_head(q) != q) {
+			fprintf(stderr, "ERROR: mem_extent_free of a bad extent %p\n", p);
+			return -1;
+		}
+	}
+	if (q != end) {
+		fprintf(stderr, "ERROR: mem_extent_free of a bad extent %p\n", p);
+		return -1;
+	}
+	for (q = p; q < end; ) {
+		char *next = q + ((size_t)PAGE_SIZE << (query_ranks(q) - 1));
+		return_pages(q);
+		q = next;
+	}
+	footprint -= (size_t)npages * PAGE_SIZE;
+	return 0;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo(){
+	return (void *)heap;
+}
+
+/*
+ * mem_heap_hi - return address of the last byte extents can cover
+ */
+void *mem_heap_hi(){
+	return (void *)(heap + MAX_HEAP - 1);
+}
+
+/*
+ * mem_heapsize() - the high water mark of the extents, the counterpart
+ *		of the brk heap size
+ */
+size_t mem_heapsize() {
+	return peak_footprint;
+}
+
+/*
+ * mem_footprint() - bytes in the extents that are live right now
+ */
+size_t mem_footprint() {
+	return footprint;
+}
+
+/*
+ * mem_pagesize() - returns the page size of the buddy allocator, which
+ *		extents are made of
+ */
+size_t mem_pagesize(){
+	return PAGE_SIZE;
+}
@@ -2,6 +2,9 @@
  * Segregated fits malloc implementation.
  * First fit placement with immediate coalescing.
  * Minimum block size is 16 bytes.
+ * With -DMEM_BUDDY the heap is a set of page extents from memlib_buddy.c
+ * instead of one brk area, and an extent that becomes entirely free is
+ * given back.
  */
 #include "mm.h"
 
@@ -55,6 +58,11 @@ struct free_list {
   void *head;
   void *tail;
 };
+static struct free_list *free_lists = NULL;
+#ifdef MEM_BUDDY
+/* The extent obtained last, while it is live */
+static char *heap_start = NULL, *heap_end = NULL;
+#endif
 
 #define PROLOGUE_SIZE (32 * sizeof(struct free_list))
 
@@ -88,6 +96,8 @@ static inline void PUT_PTR(void *p, INTERNAL_PTR_T val) {  //
 #define SET_ALLOC(p, val) (PUT(p, (GET(p) & ~0x1) | (val)))
 #define GET_PREV_ALLOC(p) ((GET(p) & 0x2) >> 1)
 #define SET_PREV_ALLOC(p, val) (PUT(p, (GET(p) & ~0x2) | (val) << 1))
+/* The first block of an extent: the word before it is not a footer */
+#define EXTENT_FIRST 0x4
 
 #define GET_PAYLOAD(p) ((char *)(p) + HEADER_SIZE)
 
@@ -126,7 +136,7 @@ static inline uint32_t __log2(const uint32_t x) {
   return y;
 }
 static inline struct free_list *get_list(uint32_t idx) {  //
-  return ((struct free_list *)heap_head) + idx;
+  return free_lists + idx;
 }
 static inline struct free_list *get_list_of(void *p) {  //
   return get_list(__log2(GET_SIZE(p)));
@@ -136,15 +146,25 @@ static inline struct free_list *get_list_of(void *p) {  //
  * mm_init - Called when a new trace starts.
  */
 int mm_init(void) {
+#ifdef MEM_BUDDY
+  /* Extents come and go, so the lists cannot live in one. Offsets are
+   * taken from the start of the region all extents are carved from. */
+  static struct free_list lists[32];
+  memset(lists, 0, sizeof(lists));
+  free_lists = lists;
+  heap_head = mem_heap_lo();
+  heap_end = NULL;
+#else
   int padding = ALIGN(HEADER_SIZE) - HEADER_SIZE;
   heap_head = mem_sbrk(PROLOGUE_SIZE + padding + HEADER_SIZE);
-  struct free_list *l = (struct free_list *)heap_head;
+  struct free_list *l = free_lists = (struct free_list *)heap_head;
   for (int i = 0; i < 32; i++) {
     l->head = NULL;
     l->tail = NULL;
     l++;
   }
   PUT(heap_head + PROLOGUE_SIZE + padding, PACK(0, 1, 1));
+#endif
   return 0;
 }
 
@@ -183,6 +203,81 @@ static inline void insert_to_free_list(void *p) {
   SET_BCK_BLOCK(p, NULL);
   l->head = p;
 }
+
+#ifdef MEM_BUDDY
+/* Back to back extents are joined up to this size */
+#define EXTENT_MAX (4 * 4096)
+
+/*
+ * new_extent - Get an extent that fits a block of need_size, and make it
+ *      one free block between a padding word and an epilogue. When the
+ *      pages come right after the extent obtained last, that extent grows
+ *      instead, as the brk heap would, and only by what its last free
+ *      block lacks.
+ */
+static void *new_extent(INTERNAL_SIZE_T need_size) {
+  size_t page = mem_pagesize();
+  size_t size = (need_size + 2 * HEADER_SIZE + page - 1) & ~(page - 1);
+  char *ext = NULL;
+  void *p;
+  if (heap_end != NULL) {
+    p = heap_end - HEADER_SIZE;
+    size_t have = GET_PREV_ALLOC(p) ? 0 : GET_SIZE(GET_PREV_BLOCK(p, GET_PREV_FOOTER(p)));
+    size_t grow = (need_size - have + page - 1) & ~(page - 1);
+    if (heap_end - heap_start + grow <= EXTENT_MAX) {
+      ext = mem_extent_alloc(grow);
+      if (ext == heap_end) {
+        // The old epilogue becomes the header.
+        PUT(p, PACK(grow, 0, GET_PREV_ALLOC(p)));
+        if (have != 0) {
+          void *prev_block = GET_PREV_BLOCK(p, GET_PREV_FOOTER(p));
+          remove_from_free_list(prev_block);
+          SET_SIZE(prev_block, have + grow);
+          p = prev_block;
+        }
+        SET_FOOTER(p);
+        heap_end = ext + grow;
+        PUT(heap_end - HEADER_SIZE, PACK(0, 1, 0));
+        insert_to_free_list(p);
+        return p;
+      }
+      if (ext != NULL && grow < size) {
+        mem_extent_free(ext, grow);
+        ext = NULL;
+      }
+    }
+  }
+  if (ext == NULL && (ext = mem_extent_alloc(size)) == NULL) return NULL;
+  p = ext + HEADER_SIZE;
+  PUT(p, PACK(size - 2 * HEADER_SIZE, 0, 1) | EXTENT_FIRST);
+  SET_FOOTER(p);
+  heap_start = ext;
+  heap_end = ext + size;
+  PUT(heap_end - HEADER_SIZE, PACK(0, 1, 0));
+  insert_to_free_list(p);
+  return p;
+}
+
+static inline int is_whole_extent(void *p) {
+  return (GET(p) & EXTENT_FIRST) && GET_SIZE(GET_NEXT_BLOCK(p)) == 0;
+}
+
+/*
+ * release_extent - Give back the extent of the free block p if p spans all of it.
+ */
+static inline void release_extent(void *p) {
+  if (is_whole_extent(p)) {
+    char *ext = (char *)p - HEADER_SIZE;
+    size_t size = GET_SIZE(p) + 2 * HEADER_SIZE;
+    remove_from_free_list(p);
+    if (ext + size == heap_end) heap_end = NULL;
+    mem_extent_free(ext, size);
+  }
+}
+#else
+static inline void release_extent(void *p) { (void)p; }
+#endif
+
 /*
  * malloc - Allocate a block.
  *      Always allocate a block whose size is a multiple of the alignment.
@@ -202,6 +297,9 @@ void *malloc(size_t size) {
     }
   }
 outer:
+#ifdef MEM_BUDDY
+  if (p == NULL && (p = new_extent(need_size)) == NULL) return NULL;
+#endif
   if (p != NULL) {
     remove_from_free_list(p);
     size_t remain = GET_SIZE(p) - need_size;
@@ -209,9 +307,7 @@ outer:
       // split block
       SET_SIZE(p, need_size);
       void *new_block = GET_NEXT_BLOCK(p);
-      SET_SIZE(new_block, remain);
-      SET_ALLOC(new_block, 0);
-      SET_PREV_ALLOC(new_block, 1);
+      PUT(new_block, PACK(remain, 0, 1));
       insert_to_free_list(new_block);
       SET_FOOTER(new_block);
     } else {
@@ -265,6 +361,7 @@ void free(void *ptr) {
       SET_FOOTER(p);
       insert_to_free_list(p);
     }
+    release_extent(p);
   } else {
     // prev block is free, get prev block
     size_t prev_footer = GET_PREV_FOOTER(p);
@@ -287,6 +384,7 @@ void free(void *ptr) {
       SET_FOOTER(prev_block);
       insert_to_free_list(prev_block);
     }
+    release_extent(prev_block);
   }
 }
 
@@ -318,7 +416,7 @@ void *realloc(void *oldptr, size_t size) {
   }
 
   /* Copy the old data. */
-  oldsize = *SIZE_PTR(oldptr);
+  oldsize = GET_SIZE(SIZE_PTR(oldptr)) - HEADER_SIZE;
   if (size < oldsize) oldsize = size;
   memcpy(newptr, oldptr, oldsize);
 
@@ -345,10 +443,16 @@ void *calloc(size_t nmemb, size_t size) {
  * mm_checkheap
  */
 void mm_checkheap(int verbose) {
+#ifdef MEM_BUDDY
+  if (verbose > 1) {
+    printf("mm_checkheap - footprint: %zu\n", mem_footprint());
+  }
+#else
   void *mem_brk = mem_sbrk(0);
   if (verbose > 1) {
     printf("mm_checkheap - mem_brk: %p\n", mem_brk);
   }
+#endif
 
   for (int i = 0; i < 32; i++) {
     struct free_list *l = get_list(i);
@@ -371,10 +475,16 @@ void mm_checkheap(int verbose) {
       if (GET_BCK_BLOCK(p) != NULL && GET_FWD_BLOCK(GET_BCK_BLOCK(p)) != p) {
         fprintf(stderr, "free block %p backward pointer is not consistent\n", p);
       }
+#ifdef MEM_BUDDY
+      if (is_whole_extent(p)) {
+        fprintf(stderr, "free block %p is a whole extent that was not given back\n", p);
+      }
+#endif
       p = GET_FWD_BLOCK(p);
     }
   }
 
+#ifndef MEM_BUDDY
   // check all blocks by address order
   char *p = heap_head + PROLOGUE_SIZE + ALIGN(HEADER_SIZE) - HEADER_SIZE;
   size_t p_size;
@@ -404,4 +514,5 @@ void mm_checkheap(int verbose) {
     p = GET_NEXT_BLOCK(p);
     prev_alloc = p_alloc;
   }
+#endif
 }